@@ -0,0 +1,86 @@
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#ifdef _WIN32
+# include <fcntl.h>
+# include <io.h>
+#endif
+
+#include "capture.h"
+
+using namespace std;
+
+FrameStreamWriter::FrameStreamWriter(const char *filename, Format format, int width, int height, int fps)
+  : format_(format), width_(width), height_(height), frame_(3 * width * height) {
+  if (strcmp(filename, "-") == 0) {
+#ifdef _WIN32
+    _setmode(_fileno(stdout), _O_BINARY);
+#endif
+    file_ = stdout;
+    ownsFile_ = false;
+  }
+  else {
+    file_ = fopen(filename, "wb");
+    ownsFile_ = true;
+    if (!file_)
+      throw runtime_error(string("FrameStreamWriter: Cannot open file ") + filename + " for write");
+  }
+
+  if (format_ == Y4M)
+    fprintf(file_, "YUV4MPEG2 W%d H%d F%d:1 Ip A1:1 C444\n", width_, height_, fps);
+}
+
+FrameStreamWriter::~FrameStreamWriter() {
+  if (ownsFile_)
+    fclose(file_);
+  else
+    fflush(file_);
+}
+
+// BT.601 studio range, as most players assume for YUV4MPEG2
+static unsigned char rgbToY(int r, int g, int b) {
+  return (unsigned char)(((66 * r + 129 * g + 25 * b + 128) >> 8) + 16);
+}
+
+static unsigned char rgbToCb(int r, int g, int b) {
+  return (unsigned char)(((-38 * r - 74 * g + 112 * b + 128) >> 8) + 128);
+}
+
+static unsigned char rgbToCr(int r, int g, int b) {
+  return (unsigned char)(((112 * r - 94 * g - 18 * b + 128) >> 8) + 128);
+}
+
+void FrameStreamWriter::writeFrame(const unsigned char *pixels) {
+  const int rowSize = 3 * width_;
+  const int planeSize = width_ * height_;
+
+  if (format_ == RAW_RGB) {
+    for (int i = 0; i < height_; ++i)
+      memcpy(&frame_[rowSize * i], pixels + rowSize * (height_ - 1 - i), rowSize);
+  }
+  else {
+    unsigned char *y = &frame_[0], *cb = y + planeSize, *cr = cb + planeSize;
+    for (int i = 0; i < height_; ++i) {
+      const unsigned char *p = pixels + rowSize * (height_ - 1 - i);
+      for (int j = 0; j < width_; ++j, p += 3) {
+        *y++ = rgbToY(p[0], p[1], p[2]);
+        *cb++ = rgbToCb(p[0], p[1], p[2]);
+        *cr++ = rgbToCr(p[0], p[1], p[2]);
+      }
+    }
+    fputs("FRAME\n", file_);
+  }
+
+  if (fwrite(&frame_[0], 1, frame_.size(), file_) != frame_.size())
+    throw runtime_error("FrameStreamWriter: Cannot write frame");
+}
+
+FrameStreamWriter::Format FrameStreamWriter::formatForFilename(const char *filename) {
+  const size_t len = strlen(filename);
+  if (strcmp(filename, "-") == 0)
+    return Y4M;
+  return len >= 4 && strcmp(filename + len - 4, ".y4m") == 0 ? Y4M : RAW_RGB;
+}
@@ -0,0 +1,164 @@
+#include <algorithm>
+#include <deque>
+#include <vector>
+
+#ifdef _WIN32
+# include <windows.h>
+#else
+# include <time.h>
+#endif
+
+#include "frametimer.h"
+
+using namespace std;
+
+double monotonicSeconds() {
+#ifdef _WIN32
+  LARGE_INTEGER frequency, counter;
+  QueryPerformanceFrequency(&frequency);
+  QueryPerformanceCounter(&counter);
+  return double(counter.QuadPart) / double(frequency.QuadPart);
+#else
+  timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec + t.tv_nsec * 1e-9;
+#endif
+}
+
+double FrameTimes::gpuBusy() const {
+  if (gpuFrame < 0)
+    return -1;
+  double busy = 0;
+  for (size_t i = 0; i < gpu.size(); ++i)
+    busy += gpu[i];
+  return busy;
+}
+
+FrameTimer::FrameTimer(int numPhases, int latency)
+  : numPhases_(numPhases), gpuTimed_(true), slots_(latency > 0 ? latency : 1), next_(0), inFlight_(0),
+    inFrame_(false), phase_(-1), frameStart_(0), phaseStart_(0), frames_(0), dropped_(0) {
+#ifndef __MAC__
+  gpuTimed_ = GLEW_VERSION_3_3 || GLEW_ARB_timer_query;
+#endif
+  if (gpuTimed_) {
+    queries_.resize(slots_.size() * (numPhases_ + 2));
+    glGenQueries((GLsizei)queries_.size(), &queries_[0]);
+    checkGlErrors();
+  }
+  for (size_t i = 0; i < slots_.size(); ++i)
+    slots_[i].ran.resize(numPhases_);
+}
+
+FrameTimer::~FrameTimer() {
+  if (!queries_.empty())
+    glDeleteQueries((GLsizei)queries_.size(), &queries_[0]);
+}
+
+void FrameTimer::beginFrame() {
+  if (inFrame_)
+    return;
+
+  collect(false);
+  if (inFlight_ == (int)slots_.size()) {
+    // the GPU is further behind than the ring: keep the CPU times only
+    Slot& oldest = slots_[next_];
+    oldest.times.gpuFrame = -1;
+    oldest.times.gpu.assign(numPhases_, -1);
+    ready_.push_back(oldest.times);
+    --inFlight_;
+    ++dropped_;
+  }
+
+  Slot& s = slots_[next_];
+  s.times.frame = frames_++;
+  s.times.cpuFrame = s.times.gpuFrame = 0;
+  s.times.cpu.assign(numPhases_, 0);
+  s.times.gpu.assign(numPhases_, gpuTimed_ ? 0 : -1);
+  s.ran.assign(numPhases_, 0);
+  if (gpuTimed_)
+    glQueryCounter(query(next_, numPhases_), GL_TIMESTAMP);
+  frameStart_ = monotonicSeconds();
+  inFrame_ = true;
+}
+
+void FrameTimer::endFrame() {
+  if (!inFrame_)
+    return;
+  endPhase();
+
+  Slot& s = slots_[next_];
+  s.times.cpuFrame = (monotonicSeconds() - frameStart_) * 1e3;
+  if (gpuTimed_) {
+    glQueryCounter(query(next_, numPhases_ + 1), GL_TIMESTAMP);
+    ++inFlight_;
+  }
+  else {
+    s.times.gpuFrame = -1;
+    ready_.push_back(s.times);
+  }
+  next_ = (next_ + 1) % slots_.size();
+  inFrame_ = false;
+}
+
+void FrameTimer::beginPhase(int phase) {
+  if (!inFrame_ || phase_ >= 0 || phase < 0 || phase >= numPhases_ || slots_[next_].ran[phase])
+    return;
+  phase_ = phase;
+  slots_[next_].ran[phase] = 1;
+  if (gpuTimed_)
+    glBeginQuery(GL_TIME_ELAPSED, query(next_, phase));
+  phaseStart_ = monotonicSeconds();
+}
+
+void FrameTimer::endPhase() {
+  if (phase_ < 0)
+    return;
+  slots_[next_].times.cpu[phase_] = (monotonicSeconds() - phaseStart_) * 1e3;
+  if (gpuTimed_)
+    glEndQuery(GL_TIME_ELAPSED);
+  phase_ = -1;
+}
+
+bool FrameTimer::poll(FrameTimes& times) {
+  collect(false);
+  if (ready_.empty())
+    return false;
+  times = ready_.front();
+  ready_.pop_front();
+  return true;
+}
+
+void FrameTimer::finish() {
+  collect(true);
+}
+
+void FrameTimer::collect(bool wait) {
+  while (inFlight_ > 0) {
+    const int i = (next_ + (int)slots_.size() - inFlight_) % (int)slots_.size();  // oldest
+    Slot& s = slots_[i];
+
+    // the GPU finishes a frame's queries in order, so once its last
+    // timestamp is in, every result of the frame is
+    if (!wait) {
+      GLuint available = 0;
+      glGetQueryObjectuiv(query(i, numPhases_ + 1), GL_QUERY_RESULT_AVAILABLE, &available);
+      if (!available)
+        break;
+    }
+
+    GLuint64 start = 0, end = 0;
+    glGetQueryObjectui64v(query(i, numPhases_), GL_QUERY_RESULT, &start);
+    glGetQueryObjectui64v(query(i, numPhases_ + 1), GL_QUERY_RESULT, &end);
+    s.times.gpuFrame = (end - start) * 1e-6;
+    for (int p = 0; p < numPhases_; ++p) {
+      if (s.ran[p]) {
+        GLuint64 elapsed = 0;
+        glGetQueryObjectui64v(query(i, p), GL_QUERY_RESULT, &elapsed);
+        // within the frame, whatever a driver makes of its first query
+        s.times.gpu[p] = min(elapsed, end - start) * 1e-6;
+      }
+    }
+    ready_.push_back(s.times);
+    --inFlight_;
+  }
+}
@@ -0,0 +1,43 @@
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include <cstdio>
+#include <vector>
+
+// Writes a stream of RGB frames of one size to a file, or to stdout for piping
+// into an encoder, either raw (rgb24, rows top to bottom) or as YUV4MPEG2 with
+// full resolution chroma (C444), which players and ffmpeg read directly
+class FrameStreamWriter {
+public:
+  enum Format {
+    RAW_RGB,
+    Y4M
+  };
+
+  // filename "-" is stdout. Throws an exception on error
+  FrameStreamWriter(const char *filename, Format format, int width, int height, int fps);
+  ~FrameStreamWriter();
+
+  // Takes tightly packed RGB pixels, rows bottom to top as glReadPixels returns
+  // them. Throws an exception on error
+  void writeFrame(const unsigned char *pixels);
+
+  int width() const { return width_; }
+  int height() const { return height_; }
+
+  // Format to use for a file name: Y4M for a .y4m file or stdout, whose readers
+  // need the frame size from the stream, RAW_RGB otherwise
+  static Format formatForFilename(const char *filename);
+
+private:
+  FILE *file_;
+  bool ownsFile_;
+  Format format_;
+  int width_, height_;
+  std::vector<unsigned char> frame_;   // the frame as written
+
+  FrameStreamWriter(const FrameStreamWriter&);
+  FrameStreamWriter& operator= (const FrameStreamWriter&);
+};
+
+#endif
@@ -0,0 +1,86 @@
+#ifndef FRAMETIMER_H
+#define FRAMETIMER_H
+
+#include <deque>
+#include <vector>
+
+#include "glsupport.h"
+
+//--------------------------------------------------------------------------------
+// Where a frame's time goes: each phase of a frame is timed on the CPU with a
+// monotonic clock and on the GPU with a GL_TIME_ELAPSED query, and the frame as
+// a whole on the GPU with GL_TIMESTAMP queries at its start and end. The query
+// results are read a few frames later, once the GPU has them, so that timing
+// never stalls the pipeline
+//--------------------------------------------------------------------------------
+
+// Seconds on a monotonic clock, from an arbitrary start
+double monotonicSeconds();
+
+// Times of one frame, in milliseconds. A phase not run in the frame has 0
+struct FrameTimes {
+  int frame;                  // counted from 0 at the first beginFrame
+  double cpuFrame;            // from beginFrame to endFrame
+  double gpuFrame;            // first timestamp to last, -1 if the GPU was not timed
+  std::vector<double> cpu;    // by phase
+  std::vector<double> gpu;    // by phase, -1 if the GPU was not timed
+
+  // GPU time spent in the phases, -1 if the GPU was not timed
+  double gpuBusy() const;
+
+  // Whether the GPU's work for the frame took longer than the CPU's, so that
+  // the GPU sets the frame rate
+  bool gpuBound() const { return gpuBusy() > cpuFrame; }
+};
+
+// Phases run one at a time, each at most once per frame. Calls outside a frame
+// are ignored, as is a phase begun while another is running, so that code run
+// both within frames and outside them (posters) can be left timed
+class FrameTimer : Noncopyable {
+public:
+  // The queries of up to `latency' frames are in flight at a time. Without
+  // timer queries (GL 3.3 or ARB_timer_query) only the CPU is timed
+  FrameTimer(int numPhases, int latency);
+  ~FrameTimer();
+
+  bool gpuTimed() const { return gpuTimed_; }
+
+  void beginFrame();
+  void endFrame();
+  void beginPhase(int phase);
+  void endPhase();
+
+  // Takes the times of the oldest frame whose results are in, if any. Never
+  // waits for the GPU
+  bool poll(FrameTimes& times);
+
+  // Waits for the frames still in flight, so that poll returns every frame
+  void finish();
+
+  // Frames still in flight when their queries were needed again, whose GPU
+  // times were given up
+  int dropped() const { return dropped_; }
+
+private:
+  struct Slot {
+    FrameTimes times;
+    std::vector<char> ran;    // by phase
+  };
+
+  // the queries of a slot: one per phase, then the start and end timestamps
+  GLuint query(int slot, int i) const { return queries_[slot * (numPhases_ + 2) + i]; }
+  void collect(bool wait);
+
+  int numPhases_;
+  bool gpuTimed_;
+  std::vector<GLuint> queries_;
+  std::vector<Slot> slots_;
+  int next_, inFlight_;       // slot of the next frame, and the slots before it still waiting on the GPU
+  bool inFrame_;
+  int phase_;                 // running, or -1
+  double frameStart_, phaseStart_;
+  int frames_, dropped_;
+  std::deque<FrameTimes> ready_;
+};
+
+#endif
@@ -0,0 +1,98 @@
+#ifndef FRUSTUM_H
+#define FRUSTUM_H
+
+#include <cmath>
+
+#include "matrix4.h"
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#  include <emmintrin.h>
+#  define FRUSTUM_USE_SSE2
+#endif
+
+//--------------------------------------------------------------------------------
+// View frustum as six planes, and sphere culling against it
+//--------------------------------------------------------------------------------
+
+// Planes are stored as (a, b, c, d) with a unit normal (a, b, c) pointing into
+// the frustum, so a point p is inside a plane when a*p.x + b*p.y + c*p.z + d >= 0
+struct Frustum {
+  float planes[6][4];
+};
+
+// Extract the frustum of a combined projection * view matrix (Gribb & Hartmann):
+// each plane is the last row of the matrix plus or minus one of the others
+inline Frustum makeFrustum(const Matrix4& projView) {
+  Frustum f;
+  for (int i = 0; i < 6; ++i) {
+    const int row = i / 2;
+    const double sign = (i % 2 == 0) ? 1 : -1;
+    double p[4];
+    for (int col = 0; col < 4; ++col)
+      p[col] = projView(3, col) + sign * projView(row, col);
+
+    const double len = std::sqrt(p[0] * p[0] + p[1] * p[1] + p[2] * p[2]);
+    for (int col = 0; col < 4; ++col)
+      f.planes[i][col] = len > CS175_EPS ? p[col] / len : p[col];
+  }
+  return f;
+}
+
+inline bool sphereInFrustum(const Frustum& f, float x, float y, float z, float radius) {
+  for (int i = 0; i < 6; ++i) {
+    const float *p = f.planes[i];
+    if (p[0] * x + p[1] * y + p[2] * z + p[3] < -radius)
+      return false;
+  }
+  return true;
+}
+
+// Test n spheres of a common radius, given as separate arrays of center
+// coordinates, against the frustum. The indices of the spheres that are at least
+// partially inside are written in order to `visible', which must have room for n
+// entries. Returns the number of visible spheres.
+inline int cullSpheres(const Frustum& f, const float *x, const float *y, const float *z,
+                       int n, float radius, int *visible) {
+  int count = 0;
+  int i = 0;
+
+#ifdef FRUSTUM_USE_SSE2
+  // four spheres at a time against each plane, then compact the survivors
+  __m128 a[6], b[6], c[6], d[6];
+  for (int j = 0; j < 6; ++j) {
+    a[j] = _mm_set1_ps(f.planes[j][0]);
+    b[j] = _mm_set1_ps(f.planes[j][1]);
+    c[j] = _mm_set1_ps(f.planes[j][2]);
+    d[j] = _mm_set1_ps(f.planes[j][3] + radius);
+  }
+  const __m128 zero = _mm_setzero_ps();
+
+  for (; i + 4 <= n; i += 4) {
+    const __m128 px = _mm_loadu_ps(x + i);
+    const __m128 py = _mm_loadu_ps(y + i);
+    const __m128 pz = _mm_loadu_ps(z + i);
+
+    __m128 inside = _mm_cmpeq_ps(zero, zero); // all ones
+    for (int j = 0; j < 6; ++j) {
+      __m128 dist = _mm_add_ps(_mm_mul_ps(a[j], px), d[j]);
+      dist = _mm_add_ps(dist, _mm_mul_ps(b[j], py));
+      dist = _mm_add_ps(dist, _mm_mul_ps(c[j], pz));
+      inside = _mm_and_ps(inside, _mm_cmpge_ps(dist, zero));
+    }
+
+    int mask = _mm_movemask_ps(inside);
+    for (int k = 0; mask; ++k, mask >>= 1) {
+      if (mask & 1)
+        visible[count++] = i + k;
+    }
+  }
+#endif
+
+  for (; i < n; ++i) {
+    if (sphereInFrustum(f, x[i], y[i], z[i], radius))
+      visible[count++] = i;
+  }
+  return count;
+}
+
+#endif
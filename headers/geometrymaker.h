@@ -1,7 +1,11 @@
 #ifndef GEOMETRYMAKER_H
 #define GEOMETRYMAKER_H
 
+#include <algorithm>
 #include <cmath>
+#include <map>
+#include <utility>
+#include <vector>
 
 #include "cvec.h"
 
@@ -10,6 +14,17 @@
 //--------------------------------------------------------------------------------
 
 
+// Attributes of a GenericVertex. Generators that take a mask of these only
+// compute the requested ones, leaving the others zero; pass the mask of the
+// vertex format being filled
+enum GenericVertexAttrib {
+  GV_POSITION = 1,
+  GV_NORMAL = 2,
+  GV_TEX = 4,
+  GV_TANGENTS = 8,            // tangent and binormal
+  GV_ALL = GV_POSITION | GV_NORMAL | GV_TEX | GV_TANGENTS
+};
+
 // A generic vertex structure containing position, normal, and texture information
 // Used by make* functions to pass vertex information to the caller
 struct GenericVertex {
@@ -124,7 +139,8 @@ inline void getSphereVbIbLen(int slices, int stacks, int& vbLen, int& ibLen) {
 }
 
 template<typename VtxOutIter, typename IdxOutIter>
-void makeSphere(float radius, int slices, int stacks, VtxOutIter vtxIter, IdxOutIter idxIter) {
+void makeSphere(float radius, int slices, int stacks, VtxOutIter vtxIter, IdxOutIter idxIter,
+                unsigned attribs = GV_ALL) {
   using namespace std;
   assert(slices > 1);
   assert(stacks >= 2);
@@ -149,14 +165,17 @@ void makeSphere(float radius, int slices, int stacks, VtxOutIter vtxIter, IdxOut
       float y = longSin[i] * latSin[j];
       float z = latCos[j];
 
-      Cvec3f n(x, y, z);
-      Cvec3f t(-longSin[i], longCos[i], 0);
-      Cvec3f b = cross(n, t);
+      Cvec3f t, b;
+      if (attribs & GV_TANGENTS) {
+        t = Cvec3f(-longSin[i], longCos[i], 0);
+        b = cross(Cvec3f(x, y, z), t);
+      }
+      const bool tex = (attribs & GV_TEX) != 0;
 
       *vtxIter = GenericVertex(
         x * radius, y * radius, z * radius,
         x, y, z,
-        1.0/slices*i, 1.0/stacks*j,
+        tex ? 1.0/slices*i : 0, tex ? 1.0/stacks*j : 0,
         t[0], t[1], t[2],
         b[0], b[1], b[2]);
       ++vtxIter;
@@ -176,4 +195,133 @@ void makeSphere(float radius, int slices, int stacks, VtxOutIter vtxIter, IdxOut
 }
 
 
+// Spheres made by subdividing a regular solid: each level splits every triangle
+// into four at its edge midpoints, pushed out onto the sphere. The vertices are
+// spread far more evenly than those of makeSphere, which crowds them at the
+// poles, so a silhouette of the same quality takes about half the triangles.
+// Vertices are shared by all their triangles; texture coordinates are longitude
+// and latitude as in makeSphere, but with no seam vertices a texture wraps
+// wrongly across the seam at longitude zero.
+
+inline void getIcosphereVbIbLen(int subdivisions, int& vbLen, int& ibLen) {
+  assert(subdivisions >= 0);
+  const int faces = 20 << (2 * subdivisions);
+  vbLen = faces / 2 + 2;      // Euler's formula for a closed triangle mesh
+  ibLen = faces * 3;
+}
+
+inline void getOctasphereVbIbLen(int subdivisions, int& vbLen, int& ibLen) {
+  assert(subdivisions >= 0);
+  const int faces = 8 << (2 * subdivisions);
+  vbLen = faces / 2 + 2;
+  ibLen = faces * 3;
+}
+
+template<typename VtxOutIter, typename IdxOutIter>
+void makeSubdividedSphere(float radius, int subdivisions,
+                          const float baseVtx[][3], int numBaseVtx,
+                          const unsigned short baseIdx[][3], int numBaseTris,
+                          VtxOutIter vtxIter, IdxOutIter idxIter, unsigned attribs) {
+  using namespace std;
+  assert(subdivisions >= 0);
+
+  vector<Cvec3f> pos;
+  for (int i = 0; i < numBaseVtx; ++i)
+    pos.push_back(normalize(Cvec3f(baseVtx[i][0], baseVtx[i][1], baseVtx[i][2])));
+  vector<unsigned short> idx(&baseIdx[0][0], &baseIdx[0][0] + numBaseTris * 3);
+
+  for (int level = 0; level < subdivisions; ++level) {
+    // each edge is split once, by whichever of its two triangles comes first
+    map<pair<int, int>, unsigned short> midpoints;
+    vector<unsigned short> next;
+    next.reserve(idx.size() * 4);
+    for (size_t t = 0; t < idx.size(); t += 3) {
+      unsigned short mid[3];
+      for (int k = 0; k < 3; ++k) {
+        const int a = idx[t + k], b = idx[t + (k + 1) % 3];
+        const pair<int, int> edge(min(a, b), max(a, b));
+        map<pair<int, int>, unsigned short>::iterator found = midpoints.find(edge);
+        if (found == midpoints.end()) {
+          found = midpoints.insert(make_pair(edge, (unsigned short)pos.size())).first;
+          pos.push_back(normalize(pos[a] + pos[b]));
+        }
+        mid[k] = found->second;
+      }
+      const unsigned short tris[12] = {
+        idx[t], mid[0], mid[2],
+        mid[0], idx[t + 1], mid[1],
+        mid[2], mid[1], idx[t + 2],
+        mid[0], mid[1], mid[2]
+      };
+      next.insert(next.end(), tris, tris + 12);
+    }
+    idx.swap(next);
+  }
+
+  const bool tex = (attribs & GV_TEX) != 0;
+  for (size_t i = 0; i < pos.size(); ++i) {
+    const Cvec3f& n = pos[i];
+
+    Cvec3f t, b;
+    if (attribs & GV_TANGENTS) {
+      // along the parallel as in makeSphere, any horizontal direction at a pole
+      const float r = sqrt(n[0] * n[0] + n[1] * n[1]);
+      t = r > CS175_EPS ? Cvec3f(-n[1] / r, n[0] / r, 0) : Cvec3f(1, 0, 0);
+      b = cross(n, t);
+    }
+    double u = 0, v = 0;
+    if (tex) {
+      u = atan2(n[1], n[0]) / (2 * CS175_PI);
+      if (u < 0)
+        u += 1;
+      v = acos(max(-1.0f, min(1.0f, n[2]))) / CS175_PI;
+    }
+
+    *vtxIter = GenericVertex(
+      n[0] * radius, n[1] * radius, n[2] * radius,
+      n[0], n[1], n[2],
+      u, v,
+      t[0], t[1], t[2],
+      b[0], b[1], b[2]);
+    ++vtxIter;
+  }
+
+  for (size_t i = 0; i < idx.size(); ++i) {
+    *idxIter = idx[i];
+    ++idxIter;
+  }
+}
+
+template<typename VtxOutIter, typename IdxOutIter>
+void makeIcosphere(float radius, int subdivisions, VtxOutIter vtxIter, IdxOutIter idxIter,
+                   unsigned attribs = GV_ALL) {
+  const float p = 1.6180339887f;  // the golden ratio
+  const float vtx[12][3] = {
+    {-1, p, 0}, {1, p, 0}, {-1, -p, 0}, {1, -p, 0},
+    {0, -1, p}, {0, 1, p}, {0, -1, -p}, {0, 1, -p},
+    {p, 0, -1}, {p, 0, 1}, {-p, 0, -1}, {-p, 0, 1}
+  };
+  const unsigned short idx[20][3] = {
+    {0, 11, 5}, {0, 5, 1}, {0, 1, 7}, {0, 7, 10}, {0, 10, 11},
+    {1, 5, 9}, {5, 11, 4}, {11, 10, 2}, {10, 7, 6}, {7, 1, 8},
+    {3, 9, 4}, {3, 4, 2}, {3, 2, 6}, {3, 6, 8}, {3, 8, 9},
+    {4, 9, 5}, {2, 4, 11}, {6, 2, 10}, {8, 6, 7}, {9, 8, 1}
+  };
+  makeSubdividedSphere(radius, subdivisions, vtx, 12, idx, 20, vtxIter, idxIter, attribs);
+}
+
+template<typename VtxOutIter, typename IdxOutIter>
+void makeOctasphere(float radius, int subdivisions, VtxOutIter vtxIter, IdxOutIter idxIter,
+                    unsigned attribs = GV_ALL) {
+  const float vtx[6][3] = {
+    {1, 0, 0}, {-1, 0, 0}, {0, 1, 0}, {0, -1, 0}, {0, 0, 1}, {0, 0, -1}
+  };
+  const unsigned short idx[8][3] = {
+    {4, 0, 2}, {4, 2, 1}, {4, 1, 3}, {4, 3, 0},
+    {5, 2, 0}, {5, 1, 2}, {5, 3, 1}, {5, 0, 3}
+  };
+  makeSubdividedSphere(radius, subdivisions, vtx, 6, idx, 8, vtxIter, idxIter, attribs);
+}
+
+
 #endif
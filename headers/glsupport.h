@@ -3,6 +3,8 @@
 
 #include <iostream>
 #include <stdexcept>
+#include <string>
+#include <vector>
 
 #ifdef __MAC__
 #   include <OpenGL/gl3.h>
@@ -166,6 +168,352 @@ public:
   }
 };
 
+// Light wrapper around a GL framebuffer object handle that automatically
+// allocates and deallocates. Can be casted to a GLuint.
+class GlFramebuffer : Noncopyable {
+protected:
+  GLuint handle_;
+
+public:
+  GlFramebuffer() {
+    glGenFramebuffers(1, &handle_);
+    checkGlErrors();
+  }
+
+  ~GlFramebuffer() {
+    glDeleteFramebuffers(1, &handle_);
+  }
+
+  // Casts to GLuint so can be used directly glBindFramebuffer and so on
+  operator GLuint() const {
+    return handle_;
+  }
+};
+
+// Light wrapper around a GL renderbuffer handle that automatically allocates
+// and deallocates. Can be casted to a GLuint.
+class GlRenderbuffer : Noncopyable {
+protected:
+  GLuint handle_;
+
+public:
+  GlRenderbuffer() {
+    glGenRenderbuffers(1, &handle_);
+    checkGlErrors();
+  }
+
+  ~GlRenderbuffer() {
+    glDeleteRenderbuffers(1, &handle_);
+  }
+
+  // Casts to GLuint so can be used directly glBindRenderbuffer and so on
+  operator GLuint() const {
+    return handle_;
+  }
+};
+
+// A buffer object handed out in pieces by a bump allocator, for data uploaded
+// once that lives as long as the arena. Many small meshes then share one buffer
+// object, and one VAO. Throws runtime_error when it runs out of room
+class GlBufferArena : Noncopyable {
+protected:
+  GLuint handle_;
+  GLsizeiptr capacity_, used_;
+
+public:
+  explicit GlBufferArena(GLsizeiptr capacity) : capacity_(capacity), used_(0) {
+    // set up through the copy target to leave the common bindings alone
+    glGenBuffers(1, &handle_);
+    glBindBuffer(GL_COPY_WRITE_BUFFER, handle_);
+    glBufferData(GL_COPY_WRITE_BUFFER, capacity, NULL, GL_STATIC_DRAW);
+    checkGlErrors();
+  }
+
+  ~GlBufferArena() {
+    glDeleteBuffers(1, &handle_);
+  }
+
+  // Claims size bytes at the next offset that is a multiple of alignment (any
+  // positive number, such as a vertex size) and returns that offset
+  GLintptr reserve(GLsizeiptr size, GLsizeiptr alignment) {
+    const GLsizeiptr offset = (used_ + alignment - 1) / alignment * alignment;
+    if (offset + size > capacity_)
+      throw std::runtime_error("GlBufferArena is full");
+    used_ = offset + size;
+    return offset;
+  }
+
+  // Copies size bytes into a newly reserved piece and returns its offset
+  GLintptr upload(const GLvoid *data, GLsizeiptr size, GLsizeiptr alignment) {
+    const GLintptr offset = reserve(size, alignment);
+    glBindBuffer(GL_COPY_WRITE_BUFFER, handle_);
+    glBufferSubData(GL_COPY_WRITE_BUFFER, offset, size, data);
+    return offset;
+  }
+
+  GLsizeiptr used() const {
+    return used_;
+  }
+
+  GLsizeiptr capacity() const {
+    return capacity_;
+  }
+
+  // Casts to GLuint so can be used directly glBindBuffer and so on
+  operator GLuint() const {
+    return handle_;
+  }
+};
+
+// Reserves count elements of type T in an arena and maps them for writing, so
+// data can be generated straight into the buffer with no copy in between:
+// begin() is an output iterator, e.g. for the make* functions of
+// geometrymaker.h, which assign each GenericVertex to a T. The range is not
+// used by the GPU yet, so mapping it never waits. Unmaps when destroyed
+template<typename T>
+class GlArenaMapping : Noncopyable {
+protected:
+  GLuint buffer_;
+  GLintptr offset_;
+  T *data_;
+  int count_;
+
+public:
+  GlArenaMapping(GlBufferArena& arena, int count)
+    : buffer_(arena), offset_(arena.reserve(sizeof(T) * count, sizeof(T))), count_(count) {
+    glBindBuffer(GL_COPY_WRITE_BUFFER, buffer_);
+    data_ = (T *)glMapBufferRange(GL_COPY_WRITE_BUFFER, offset_, sizeof(T) * count,
+                                  GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_RANGE_BIT | GL_MAP_UNSYNCHRONIZED_BIT);
+    if (data_ == NULL)
+      throw std::runtime_error("glMapBufferRange fails");
+  }
+
+  ~GlArenaMapping() {
+    glBindBuffer(GL_COPY_WRITE_BUFFER, buffer_);
+    glUnmapBuffer(GL_COPY_WRITE_BUFFER);
+  }
+
+  T *begin() {
+    return data_;
+  }
+
+  T *end() {
+    return data_ + count_;
+  }
+
+  // Index of the first element in the arena, e.g. a base vertex or first index
+  GLint first() const {
+    return offset_ / sizeof(T);
+  }
+};
+
+// Shadows the GL bindings most often changed between draws, plus blending, and
+// drops calls that would set them to what they already are. Everything that
+// changes the tracked state must go through the cache (or call invalidate()
+// afterwards). Buffer targets not listed in targetIndex, such as
+// GL_ELEMENT_ARRAY_BUFFER which belongs to the bound VAO, are passed through.
+// Counts the calls issued and skipped, so the savings can be reported.
+class GlStateCache : Noncopyable {
+protected:
+  enum { NUM_TARGETS = 5 };
+  static const GLuint UNKNOWN = ~0u;  // never a valid object name
+
+  GLuint program_, vao_;
+  GLuint buffers_[NUM_TARGETS];
+  GLuint blend_;                      // GL_TRUE, GL_FALSE or UNKNOWN
+  GLenum blendSrc_, blendDst_;
+  long issued_, skipped_;
+
+  static int targetIndex(GLenum target) {
+    switch (target) {
+    case GL_ARRAY_BUFFER: return 0;
+    case GL_UNIFORM_BUFFER: return 1;
+    case GL_PIXEL_PACK_BUFFER: return 2;
+#ifndef __MAC__
+    case GL_SHADER_STORAGE_BUFFER: return 3;
+    case GL_DRAW_INDIRECT_BUFFER: return 4;
+#endif
+    default: return -1;
+    }
+  }
+
+  // Records the new value and returns true if the call has to be made
+  bool update(GLuint& cached, GLuint value) {
+    if (cached == value) {
+      ++skipped_;
+      return false;
+    }
+    cached = value;
+    ++issued_;
+    return true;
+  }
+
+public:
+  GlStateCache() : issued_(0), skipped_(0) {
+    invalidate();
+  }
+
+  // Forget everything, e.g. after GL calls that bypassed the cache
+  void invalidate() {
+    program_ = vao_ = UNKNOWN;
+    for (int i = 0; i < NUM_TARGETS; ++i)
+      buffers_[i] = UNKNOWN;
+    blend_ = blendSrc_ = blendDst_ = UNKNOWN;
+  }
+
+  void useProgram(GLuint program) {
+    if (update(program_, program))
+      glUseProgram(program);
+  }
+
+  void bindVertexArray(GLuint vao) {
+    if (update(vao_, vao))
+      glBindVertexArray(vao);
+  }
+
+  void bindBuffer(GLenum target, GLuint buffer) {
+    const int i = targetIndex(target);
+    if (i < 0) {
+      ++issued_;
+      glBindBuffer(target, buffer);
+    }
+    else if (update(buffers_[i], buffer))
+      glBindBuffer(target, buffer);
+  }
+
+  // Indexed binds are always made, but also set the target's generic binding
+  void bindBufferBase(GLenum target, GLuint index, GLuint buffer) {
+    ++issued_;
+    glBindBufferBase(target, index, buffer);
+    const int i = targetIndex(target);
+    if (i >= 0)
+      buffers_[i] = buffer;
+  }
+
+  void setBlend(bool enabled) {
+    if (update(blend_, enabled ? GL_TRUE : GL_FALSE)) {
+      if (enabled)
+        glEnable(GL_BLEND);
+      else
+        glDisable(GL_BLEND);
+    }
+  }
+
+  void blendFunc(GLenum src, GLenum dst) {
+    if (blendSrc_ == src && blendDst_ == dst) {
+      ++skipped_;
+      return;
+    }
+    blendSrc_ = src;
+    blendDst_ = dst;
+    ++issued_;
+    glBlendFunc(src, dst);
+  }
+
+  // For callers that skip redundant state the cache cannot see, such as
+  // attribute pointers stored in a VAO
+  void countSkipped(long calls) {
+    skipped_ += calls;
+  }
+
+  long issued() const {
+    return issued_;
+  }
+
+  long skipped() const {
+    return skipped_;
+  }
+
+  void resetCounters() {
+    issued_ = skipped_ = 0;
+  }
+};
+
+#ifndef __MAC__
+// A buffer object split into a ring of equal regions that stays mapped for its
+// whole lifetime, for data the CPU writes every frame and the GPU reads. The CPU
+// fills one region while the GPU may still be reading the others, and a fence
+// per region keeps a region from being rewritten before the commands reading it
+// have finished, so with enough regions writing never waits on the driver.
+// Needs GL 4.4 or ARB_buffer_storage (see isSupported).
+class GlStreamRing : Noncopyable {
+protected:
+  GLuint handle_;
+  GLsizeiptr regionSize_;
+  int current_;
+  char *mapped_;
+  std::vector<GLsync> fences_;
+  long stalls_;
+
+public:
+  // The region size is rounded up to a multiple of 256 bytes so every region
+  // meets the offset alignment of any buffer binding point
+  GlStreamRing(GLsizeiptr regionSize, int numRegions = 3)
+    : regionSize_((regionSize + 255) / 256 * 256), current_(-1), fences_(numRegions, (GLsync)0), stalls_(0) {
+    const GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+    // set up through the copy target to leave the common bindings alone
+    glGenBuffers(1, &handle_);
+    glBindBuffer(GL_COPY_WRITE_BUFFER, handle_);
+    glBufferStorage(GL_COPY_WRITE_BUFFER, regionSize_ * numRegions, NULL, flags);
+    mapped_ = (char *)glMapBufferRange(GL_COPY_WRITE_BUFFER, 0, regionSize_ * numRegions, flags);
+    if (mapped_ == NULL)
+      throw std::runtime_error("glMapBufferRange fails");
+    checkGlErrors();
+  }
+
+  ~GlStreamRing() {
+    for (size_t i = 0; i < fences_.size(); ++i) {
+      if (fences_[i])
+        glDeleteSync(fences_[i]);
+    }
+    glDeleteBuffers(1, &handle_); // also unmaps it
+  }
+
+  static bool isSupported() {
+    return GLEW_VERSION_4_4 || GLEW_ARB_buffer_storage;
+  }
+
+  // Moves on to the next region, waiting in the unlikely case that the GPU is
+  // still reading it, and returns where to write it
+  void *beginRegion() {
+    current_ = (current_ + 1) % (int)fences_.size();
+    GLsync& fence = fences_[current_];
+    if (fence) {
+      GLenum r = glClientWaitSync(fence, 0, 0);
+      if (r == GL_TIMEOUT_EXPIRED) {
+        ++stalls_;
+        do {
+          r = glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000); // 1ms
+        } while (r == GL_TIMEOUT_EXPIRED);
+      }
+      glDeleteSync(fence);
+      fence = 0;
+    }
+    return mapped_ + regionOffset();
+  }
+
+  // Fences the current region. Call after issuing every command that reads it
+  void endRegion() {
+    fences_[current_] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+  }
+
+  // Byte offset of the current region in the buffer, for attribute pointers
+  GLintptr regionOffset() const {
+    return (GLintptr)regionSize_ * current_;
+  }
+
+  // Number of times beginRegion had to wait for the GPU
+  long stalls() const {
+    return stalls_;
+  }
+
+  // Casts to GLuint so can be used directly glBindBuffer and so on
+  operator GLuint() const {
+    return handle_;
+  }
+};
+#endif
+
 // Safe versions of various functions that handle GLSL shader attributes
 // and variables: These mainly issue a warning when specified attributes
 // and variables do not exist in the compiled GLSL program (e.g., due to
@@ -186,6 +534,15 @@ inline GLint safe_glGetAttribLocation(const GLuint program, const char varname[]
   return r;
 }
 
+inline void safe_glUniformBlockBinding(const GLuint program, const char blockname[], const GLuint binding) {
+  const GLuint index = glGetUniformBlockIndex(program, blockname);
+  if (index == GL_INVALID_INDEX) {
+    std::cerr << "WARN: "<< blockname << " cannot be bound (it either doesn't exist or has been optimized away). Its uniform buffer will be ignored.\n" << std::endl;
+    return;
+  }
+  glUniformBlockBinding(program, index, binding);
+}
+
 inline void safe_glUniformMatrix4fv(const GLint handle, const GLfloat data[]) {
   if (handle >= 0)
     glUniformMatrix4fv(handle, 1, GL_FALSE, data);
@@ -246,6 +603,11 @@ inline void safe_glVertexAttribPointer(const GLint handle, GLint size, GLenum ty
     glVertexAttribPointer(handle, size, type, normalized, stride, pointer);
 }
 
+inline void safe_glVertexAttribDivisor(const GLint handle, const GLuint divisor) {
+  if (handle >= 0)
+    glVertexAttribDivisor(handle, divisor);
+}
+
 inline void safe_glVertexAttrib1f(const GLint handle, const GLfloat a) {
   if (handle >= 0)
     glVertexAttrib1f(handle, a);
@@ -0,0 +1,28 @@
+#ifndef MAPPEDFILE_H
+#define MAPPEDFILE_H
+
+#include <cstddef>
+
+// A whole file mapped read-only into memory, so it can be parsed in place with
+// no read calls or copies. Throws an exception on error
+class MappedFile {
+public:
+  explicit MappedFile(const char *filename);
+  ~MappedFile();
+
+  // NULL for an empty file
+  const unsigned char *data() const { return data_; }
+  size_t size() const { return size_; }
+
+private:
+  const unsigned char *data_;
+  size_t size_;
+#ifdef _WIN32
+  void *file_, *mapping_;
+#endif
+
+  MappedFile(const MappedFile&);
+  MappedFile& operator= (const MappedFile&);
+};
+
+#endif
@@ -0,0 +1,200 @@
+#ifndef MESHOPT_H
+#define MESHOPT_H
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <vector>
+
+//--------------------------------------------------------------------------------
+// Reordering of indexed triangle meshes for the post-transform vertex cache and
+// for vertex fetch, to be run on the output of geometrymaker.h before upload
+//--------------------------------------------------------------------------------
+
+// Average cache miss ratio: vertex shader runs per triangle when the indices go
+// through a FIFO post-transform cache of cacheSize entries. 3 means no reuse at
+// all, and about 0.5 is the best a large regular mesh can do
+inline double computeAcmr(const unsigned short *idx, int ibLen, int vbLen, int cacheSize = 16) {
+  if (ibLen < 3)
+    return 0;
+
+  // a vertex is in the cache if fewer than cacheSize misses happened since its own
+  std::vector<int> missedAt(vbLen, -cacheSize - 1);
+  int misses = 0;
+  for (int i = 0; i < ibLen; ++i) {
+    if (misses - missedAt[idx[i]] > cacheSize)
+      missedAt[idx[i]] = misses++;
+  }
+  return double(misses) / (ibLen / 3);
+}
+
+// Scoring of Tom Forsyth's "Linear-Speed Vertex Cache Optimisation": vertices
+// recently used score high, as do vertices with few triangles left to draw
+enum { FORSYTH_CACHE_SIZE = 32 };
+
+inline float forsythVertexScore(int cachePos, int liveTris) {
+  if (liveTris == 0)
+    return -1;
+
+  float score = 0;
+  if (cachePos >= 0) {
+    if (cachePos < 3)
+      score = 0.75f;            // just used: lower, to avoid strip-like order
+    else
+      score = std::pow(1 - (cachePos - 3) * (1.0f / (FORSYTH_CACHE_SIZE - 3)), 1.5f);
+  }
+  return score + 2.0f / std::sqrt(float(liveTris));
+}
+
+// Reorders the triangles of an indexed mesh in place so that they reuse the
+// vertices still in the post-transform cache: each step draws the triangle with
+// the best scoring vertices, looking only at the triangles of the cached ones
+inline void optimizeVertexCache(unsigned short *idx, int ibLen, int vbLen) {
+  assert(ibLen % 3 == 0);
+  const int numTris = ibLen / 3;
+  if (numTris == 0)
+    return;
+
+  // triangles of each vertex, the live ones first in its range of triList
+  std::vector<int> liveTris(vbLen, 0), triStart(vbLen + 1, 0), triList(ibLen);
+  for (int i = 0; i < ibLen; ++i)
+    ++liveTris[idx[i]];
+  for (int v = 0; v < vbLen; ++v)
+    triStart[v + 1] = triStart[v] + liveTris[v];
+  std::vector<int> fill(triStart.begin(), triStart.end() - 1);
+  for (int i = 0; i < ibLen; ++i)
+    triList[fill[idx[i]]++] = i / 3;
+
+  std::vector<int> cachePos(vbLen, -1);
+  std::vector<float> vertexScore(vbLen);
+  for (int v = 0; v < vbLen; ++v)
+    vertexScore[v] = forsythVertexScore(-1, liveTris[v]);
+
+  std::vector<float> triScore(numTris);
+  for (int t = 0; t < numTris; ++t)
+    triScore[t] = vertexScore[idx[3*t]] + vertexScore[idx[3*t + 1]] + vertexScore[idx[3*t + 2]];
+
+  std::vector<char> drawn(numTris, 0);
+  std::vector<unsigned short> out;
+  out.reserve(ibLen);
+
+  int cache[FORSYTH_CACHE_SIZE + 3];
+  int cacheLen = 0;
+  int best = -1;
+
+  for (int n = 0; n < numTris; ++n) {
+    if (best < 0) {
+      // nothing cached has a triangle left, so take the best of all
+      for (int t = 0; t < numTris; ++t) {
+        if (!drawn[t] && (best < 0 || triScore[t] > triScore[best]))
+          best = t;
+      }
+    }
+
+    drawn[best] = 1;
+    int newCache[FORSYTH_CACHE_SIZE + 3];
+    int newLen = 0;
+    for (int k = 0; k < 3; ++k) {
+      const int v = idx[3*best + k];
+      out.push_back(v);
+
+      // move the triangle out of the live part of the vertex's range
+      int *tris = &triList[triStart[v]];
+      for (int j = 0; j < liveTris[v]; ++j) {
+        if (tris[j] == best) {
+          std::swap(tris[j], tris[liveTris[v] - 1]);
+          --liveTris[v];
+          break;
+        }
+      }
+
+      bool seen = false;
+      for (int j = 0; j < newLen; ++j)
+        seen = seen || newCache[j] == v;
+      if (!seen)
+        newCache[newLen++] = v;
+    }
+    for (int j = 0; j < cacheLen; ++j) {
+      const int v = cache[j];
+      if (v != newCache[0] && (newLen < 2 || v != newCache[1]) && (newLen < 3 || v != newCache[2]))
+        newCache[newLen++] = v;
+    }
+
+    // rescore everything that was or is cached, then the live triangles of the
+    // cached vertices, of which the best is drawn next
+    for (int j = 0; j < newLen; ++j) {
+      const int v = newCache[j];
+      cachePos[v] = j < FORSYTH_CACHE_SIZE ? j : -1;
+      vertexScore[v] = forsythVertexScore(cachePos[v], liveTris[v]);
+    }
+    best = -1;
+    for (int j = 0; j < newLen && j < FORSYTH_CACHE_SIZE; ++j) {
+      const int v = newCache[j];
+      for (int k = 0; k < liveTris[v]; ++k) {
+        const int t = triList[triStart[v] + k];
+        triScore[t] = vertexScore[idx[3*t]] + vertexScore[idx[3*t + 1]] + vertexScore[idx[3*t + 2]];
+        if (best < 0 || triScore[t] > triScore[best])
+          best = t;
+      }
+    }
+
+    cacheLen = newLen < FORSYTH_CACHE_SIZE ? newLen : FORSYTH_CACHE_SIZE;
+    for (int j = 0; j < cacheLen; ++j)
+      cache[j] = newCache[j];
+  }
+
+  for (int i = 0; i < ibLen; ++i)
+    idx[i] = out[i];
+}
+
+// Renumbers the vertices in the order the indices first use them, so that
+// vertex fetches walk forward through memory. remap gets the new number of each
+// old vertex, or -1 for a vertex that is never used; the vertices themselves
+// are to be moved accordingly, e.g. with RemapOutputIter. Returns the number of
+// vertices used
+inline int optimizeVertexFetch(unsigned short *idx, int ibLen, int vbLen, std::vector<int>& remap) {
+  remap.assign(vbLen, -1);
+  int next = 0;
+  for (int i = 0; i < ibLen; ++i) {
+    if (remap[idx[i]] < 0)
+      remap[idx[i]] = next++;
+    idx[i] = remap[idx[i]];
+  }
+  return next;
+}
+
+// Output iterator that stores the k-th value assigned through it to
+// dst[remap[k]], skipping those with no place, so a generator can write its
+// vertices straight into the order given by optimizeVertexFetch
+template<typename T>
+class RemapOutputIter {
+  T *dst_;
+  const int *remap_;
+  int k_;
+
+public:
+  RemapOutputIter(T *dst, const int *remap) : dst_(dst), remap_(remap), k_(0) {}
+
+  template<typename S>
+  RemapOutputIter& operator = (const S& s) {
+    if (remap_[k_] >= 0)
+      dst_[remap_[k_]] = s;
+    return *this;
+  }
+
+  RemapOutputIter& operator * () { return *this; }
+  RemapOutputIter& operator ++ () { ++k_; return *this; }
+};
+
+// Output iterator that drops whatever is assigned through it, for the outputs
+// of a generator that are not wanted
+class DiscardOutputIter {
+public:
+  template<typename S>
+  DiscardOutputIter& operator = (const S&) { return *this; }
+
+  DiscardOutputIter& operator * () { return *this; }
+  DiscardOutputIter& operator ++ () { return *this; }
+};
+
+#endif
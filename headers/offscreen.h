@@ -0,0 +1,15 @@
+#ifndef OFFSCREEN_H
+#define OFFSCREEN_H
+
+// Creates an OpenGL context with no window and makes it current, for rendering
+// into framebuffer objects on headless machines. The context comes from EGL when
+// built with OFFSCREEN_EGL defined (linking -lEGL), which covers GPU render
+// nodes as well as Mesa's software rasterizers, or from OSMesa when built with
+// OFFSCREEN_OSMESA (linking -lOSMesa). Throws runtime_error if neither is built
+// in or no context can be made.
+void createOffscreenContext();
+
+// Name of the way the context was made, for messages
+const char *offscreenContextKind();
+
+#endif
@@ -1,10 +1,37 @@
 #ifndef PPM_H
 #define PPM_H
 
+#include <fstream>
+#include <string>
 #include <vector>
 
+#include "mappedfile.h"
+
 void writePpmScreenshot(const int width, const int height, const char *filename);
 
+// Writes tightly packed RGB pixels, rows bottom to top as glReadPixels returns
+// them, to a binary PPM file. Throws an exception on error.
+void writePpm(const char *filename, int width, int height, const unsigned char *pixels);
+
+// A binary PPM file written a band of rows at a time, top to bottom, for images
+// too large to hold in memory whole. Throws an exception on error.
+class PpmStreamWriter {
+public:
+  PpmStreamWriter(const char *filename, int width, int height);
+
+  // Appends `rows' rows of tightly packed RGB pixels, given bottom to top as
+  // glReadPixels returns them; the band's top row goes to the file first
+  void writeRows(const unsigned char *pixels, int rows);
+
+  // Flushes and closes the file, checking that every row was written
+  void close();
+
+private:
+  std::ofstream file_;
+  std::string filename_;
+  int width_, height_, written_;
+};
+
 
 // A 3-byte structure storing R,G,B value of a pixel
 struct PackedPixel {
@@ -15,4 +42,27 @@ struct PackedPixel {
 // and `height'. Throws an exception on error.
 void ppmRead(const char *filename, int& width, int& height, std::vector<PackedPixel>& pixels);
 
+// A PPM file read through a memory mapping, with the header parsed once. The
+// pixels of a binary (P6) file are used in place with no copy; those of an ASCII
+// (P3) file are decoded into a buffer. Rows are top to bottom, as stored (unlike
+// ppmRead, which returns them bottom to top). Throws an exception on error.
+class PpmImage {
+public:
+  explicit PpmImage(const char *filename);
+
+  int width() const { return width_; }
+  int height() const { return height_; }
+
+  // width * height pixels, the top row first
+  const PackedPixel *pixels() const { return pixels_; }
+
+  const PackedPixel *row(int y) const { return pixels_ + (size_t)y * width_; }
+
+private:
+  MappedFile file_;
+  int width_, height_;
+  const PackedPixel *pixels_;
+  std::vector<PackedPixel> decoded_;
+};
+
 #endif
@@ -0,0 +1,71 @@
+#ifndef PROGRAMCACHE_H
+#define PROGRAMCACHE_H
+
+#include <string>
+#include <vector>
+
+#include "glsupport.h"
+
+//--------------------------------------------------------------------------------
+// Building of the shader programs at startup. Every program is queued before any
+// is waited on, so that a driver with GL_KHR_parallel_shader_compile compiles
+// them side by side, and each linked program is kept on disk as a binary
+// (glGetProgramBinary), keyed by a hash of its sources, attribute bindings and
+// the driver, so that later launches load it instead of compiling
+//--------------------------------------------------------------------------------
+
+// Specializes a shader source for a set of features: "#define NAME 1" for each
+// space separated name in `defines' goes just after the #version line, so that
+// the preprocessor leaves out the code of the features not wanted
+std::string specializeShaderSource(const std::string& source, const std::string& defines);
+
+class ProgramCache : Noncopyable {
+public:
+  // Binaries are files in `dir', which is created if need be. With an empty
+  // dir, or a driver with no binary formats, every program is compiled
+  explicit ProgramCache(const std::string& dir);
+  ~ProgramCache();
+
+  // Builds a program from a vertex and a fragment shader file, both
+  // specialized for `defines', with the vertex attribute names[i] bound to
+  // location i and fragColor to color number 0: right away from a cached
+  // binary, or else by starting its compiles and link. The program may be used
+  // once finish returns. Throws runtime_error if a file cannot be read
+  void addProgram(GLuint programHandle, const char *vertexShaderFileName, const char *fragmentShaderFileName,
+                  int count = 0, const char * const names[] = NULL, const std::string& defines = std::string());
+
+#ifndef __MAC__
+  // Same for a program of a single compute shader
+  void addComputeProgram(GLuint programHandle, const char *computeShaderFileName);
+#endif
+
+  // Waits for the programs being built, storing the binary of each as soon as
+  // it is linked. Throws runtime_error on a program that does not compile or
+  // link, after printing the log
+  void finish();
+
+  int loaded() const { return loaded_; }      // programs from binaries
+  int compiled() const { return compiled_; }  // programs built from source
+
+private:
+  struct Pending {
+    GLuint program;
+    GLuint shaders[2];      // 0 where unused
+    std::string files[2];
+    std::string defines;    // for the messages
+    std::string key;
+  };
+
+  bool loadBinary(GLuint programHandle, const std::string& key);
+  void storeBinary(GLuint programHandle, const std::string& key);
+  void start(Pending& p, const GLenum types[2], const std::string sources[2], int count, const char * const names[]);
+  void complete(Pending& p);
+
+  std::string dir_;
+  std::string driver_;      // vendor, renderer and version, part of every key
+  bool binaries_, parallel_;
+  std::vector<Pending> pending_;
+  int loaded_, compiled_;
+};
+
+#endif
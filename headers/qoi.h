@@ -0,0 +1,31 @@
+#ifndef QOI_H
+#define QOI_H
+
+#include <cstddef>
+#include <vector>
+
+#include "ppm.h"
+
+//--------------------------------------------------------------------------------
+// Lossless image compression in the "Quite OK Image" format (qoiformat.org):
+// every pixel is coded in one pass as a run, a reference to a recently seen
+// color, or a small difference from the previous pixel, which compresses frames
+// of mostly flat color several times over at close to memory speed
+//--------------------------------------------------------------------------------
+
+// Appends the QOI file of an RGB image to `out'. Like writePpm, takes tightly
+// packed pixels with the rows bottom to top as glReadPixels returns them.
+void qoiEncode(const unsigned char *pixels, int width, int height, std::vector<unsigned char>& out);
+
+// Decodes a QOI file into pixels with the rows top to bottom, dropping any
+// alpha. Throws an exception on error.
+void qoiDecode(const unsigned char *data, size_t size, int& width, int& height, std::vector<PackedPixel>& pixels);
+
+// Writes an RGB image, rows bottom to top, to a QOI file. Throws an exception on
+// error.
+void writeQoi(const char *filename, int width, int height, const unsigned char *pixels);
+
+// Reads a QOI file, rows top to bottom. Throws an exception on error.
+void qoiRead(const char *filename, int& width, int& height, std::vector<PackedPixel>& pixels);
+
+#endif
@@ -0,0 +1,49 @@
+#ifndef SPRITEATLAS_H
+#define SPRITEATLAS_H
+
+#include <cstddef>
+#include <string>
+#include <vector>
+
+//--------------------------------------------------------------------------------
+// Sprite frames packed into one RGBA texture, with the mip chain built on the
+// CPU, so that a whole particle set can sample flipbook frames by index with a
+// single texture bound
+//--------------------------------------------------------------------------------
+
+// Downsamples an RGBA image to half size (at least 1 pixel each way), each
+// pixel the rounded average of the 2x2 (or at an odd edge, 2x1) box above it
+void downsampleRgbaBox(const unsigned char *src, int width, int height, unsigned char *dst);
+
+// The frames are laid out left to right and top to bottom in a grid of square
+// cells, a power of two on a side, each frame centered in its cell on a
+// transparent background. Since the cells are a power of two, a 2x2 box at any
+// level falls within one cell, and the frames never bleed into each other down
+// to the last level, where a cell is one pixel. Throws an exception on error.
+class SpriteAtlas {
+public:
+  // Each file is a PPM with a frame's color above its opacity (the red
+  // channel), as with the ramps; all frames must be the same size
+  explicit SpriteAtlas(const std::vector<std::string>& files);
+
+  int frames() const { return frames_; }
+  int columns() const { return columns_; }
+  int rows() const { return rows_; }
+  int cellSize() const { return cellSize_; }      // at level 0
+  int levels() const { return (int)offsets_.size(); }
+
+  int width(int level) const { return columns_ * (cellSize_ >> level); }
+  int height(int level) const { return rows_ * (cellSize_ >> level); }
+
+  // Every level, tightly packed RGBA with the rows bottom to top as
+  // glTexImage2D takes them, one after the other from level 0
+  const std::vector<unsigned char>& data() const { return data_; }
+  size_t offset(int level) const { return offsets_[level]; }
+
+private:
+  int frames_, columns_, rows_, cellSize_;
+  std::vector<unsigned char> data_;
+  std::vector<size_t> offsets_;
+};
+
+#endif
@@ -0,0 +1,55 @@
+#ifndef VERTEXPACK_H
+#define VERTEXPACK_H
+
+#include <string.h>
+
+//--------------------------------------------------------------------------------
+// Packing of vertex attributes into compact GL formats
+//--------------------------------------------------------------------------------
+
+// Converts a float to IEEE half precision bits (GL_HALF_FLOAT), rounding to
+// nearest with ties to even. Out of range values become infinity and tiny ones denormals or zero
+inline unsigned short packHalf(float f) {
+  unsigned int u;
+  memcpy(&u, &f, sizeof(u));
+
+  const unsigned int sign = (u >> 16) & 0x8000;
+  const int biased = (u >> 23) & 0xff;
+  unsigned int mant = u & 0x7fffff;
+
+  if (biased == 0xff)                    // infinity or NaN
+    return sign | 0x7c00 | (mant ? 0x200 : 0);
+
+  const int exp = biased - 127 + 15;
+  if (exp >= 31)                         // too large
+    return sign | 0x7c00;
+  if (exp <= 0) {                        // denormal or zero in half precision
+    if (exp < -10)
+      return sign;
+    mant |= 0x800000;
+    const int shift = 14 - exp;
+    return sign | ((mant + (1u << (shift - 1)) - 1 + ((mant >> shift) & 1)) >> shift);
+  }
+
+  // a carry out of the mantissa correctly bumps the exponent, to infinity at most
+  return sign | ((exp << 10) + ((mant + 0xfff + ((mant >> 13) & 1)) >> 13));
+}
+
+// Packs a vector with components in [-1, 1] as GL_INT_2_10_10_10_REV, to be read
+// as a normalized attribute: x in the low 10 bits, then y, z, and w in the top 2
+inline unsigned int packSnorm1010102(float x, float y, float z, float w = 0) {
+  const float c[4] = { x, y, z, w };
+  const float scale[4] = { 511, 511, 511, 1 };
+  const unsigned int mask[4] = { 0x3ff, 0x3ff, 0x3ff, 0x3 };
+
+  unsigned int r = 0;
+  for (int i = 0, shift = 0; i < 4; shift += 10, ++i) {
+    float v = c[i] < -1 ? -1 : (c[i] > 1 ? 1 : c[i]);
+    v *= scale[i];
+    const int q = (int)(v < 0 ? v - 0.5f : v + 0.5f);
+    r |= ((unsigned int)q & mask[i]) << shift;
+  }
+  return r;
+}
+
+#endif
@@ -0,0 +1,44 @@
+#ifndef WORKER_H
+#define WORKER_H
+
+//--------------------------------------------------------------------------------
+// A background thread working through a bounded queue of jobs, used to keep file
+// encoding and writing off the render thread
+//--------------------------------------------------------------------------------
+
+// A unit of work for a WorkerThread, deleted once it has run. run() should not
+// throw; a job that does has its error printed and is dropped
+class WorkerJob {
+public:
+  virtual ~WorkerJob() {}
+  virtual void run() = 0;
+};
+
+// Jobs run one at a time in the order they are posted. Destroying the worker
+// runs the jobs still queued, then joins the thread
+class WorkerThread {
+public:
+  // at most maxQueued jobs wait at a time, not counting the running one
+  explicit WorkerThread(int maxQueued);
+  ~WorkerThread();
+
+  // Takes ownership of the job, waiting for room in the queue if it is full
+  void post(WorkerJob *job);
+
+  // Takes ownership of the job only if the queue has room, and returns whether
+  // it did. Never waits
+  bool tryPost(WorkerJob *job);
+
+  // Number of jobs queued or running
+  int pending() const;
+
+  struct Impl;
+
+private:
+  Impl *impl_;
+
+  WorkerThread(const WorkerThread&);
+  WorkerThread& operator= (const WorkerThread&);
+};
+
+#endif
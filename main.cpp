@@ -2,8 +2,16 @@
 #include <string>
 #include <memory>
 #include <stdexcept>
+#include <queue>
+#include <deque>
+#include <functional>
+#include <utility>
+#include <algorithm>
 #include <math.h>
 #include <time.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
 
 #if __GNUG__
 #   include <tr1/memory>
@@ -25,6 +33,16 @@
 #include "headers/quat.h"
 #include "headers/rigtform.h"
 #include "headers/arcball.h"
+#include "headers/frustum.h"
+#include "headers/vertexpack.h"
+#include "headers/meshopt.h"
+#include "headers/worker.h"
+#include "headers/capture.h"
+#include "headers/offscreen.h"
+#include "headers/qoi.h"
+#include "headers/spriteatlas.h"
+#include "headers/programcache.h"
+#include "headers/frametimer.h"
 
 using namespace std;      // for string, vector, iostream, and other standard C++ stuff
 using namespace tr1; // for shared_ptr
@@ -33,7 +51,6 @@ using namespace tr1; // for shared_ptr
 
 					 // G L O B A L S ///////////////////////////////////////////////////
 
-static const bool g_Gl2Compatible = false;
 static const float g_frustMinFov = 60.0;  // A minimal of 60 degree field of view
 static float g_frustFovY = g_frustMinFov; // FOV in y direction (updated by updateFrustFovY)
 static const float g_frustNear = -0.1;    // near plane
@@ -51,72 +68,306 @@ static bool g_worldFrame = true;
 static int g_mouseClickX, g_mouseClickY; // coordinates for mouse click event
 static int g_activeShader = 0;
 const int MaxParticles = 3000;
+static const float g_particleRadius = 7.0;   // radius of the particle sphere mesh
+static const float g_particleScale = 0.02;   // uniform scale applied to the particle sphere
+static const float g_ageStep = 0.02;         // age added to every particle per simulation step
+static const float g_fireForceStep = 0.005;  // upward force added to fire particles per step
+static const float g_smokeForceStep = 0.0005;// upward force added to smoke particles per step
+
+// Ways of advancing and drawing the particle system, cycled with 'p'
+enum ParticleBackend {
+	PB_CPU = 0,       // reference: integrate on the CPU, upload instances every frame
+	PB_CLOSED_FORM,   // upload spawn state only, evaluate trajectories in the vertex shader
+	PB_COMPUTE,       // keep particles in a shader storage buffer, step them in a compute shader
+	PB_NUM_BACKENDS
+};
+static int g_particleBackend = PB_CPU;
+static int g_simStep = 0;                // number of simulation steps taken so far
+static bool g_simulate = true;           // drawStuff takes a step; off to redraw the same one
+static bool g_cullParticles = true;      // frustum cull particles before upload, toggled with 'c'
+static bool g_particleLod = true;        // pick sphere tessellation by screen size, toggled with 'l'
+static bool g_particleImpostors = false;  // ray-cast spheres on quads instead, toggled with 'i'
+static bool g_particleSprites = false;    // flipbook sprites on quads instead, toggled with 'k'
+static const int g_cullReportSteps = 300;// steps between culling reports
+
+static GlStateCache g_glState;           // every program, VAO and buffer bind goes through this
+
+// Phases of a frame timed by g_frameTimer, on the CPU and the GPU
+enum FramePhase {
+	FP_CLEAR = 0,
+	FP_UPDATE,        // simulation step, or spawn upload for PB_CLOSED_FORM
+	FP_CULL,          // PB_COMPUTE culling
+	FP_UPLOAD,        // PB_CPU culling, level of detail and instance upload
+	FP_DRAW,
+	FP_HUD,
+	FP_READBACK,
+	FP_NUM_PHASES
+};
+static const char * const g_framePhaseNames[FP_NUM_PHASES] = {
+	"clear", "update", "cull", "upload", "draw", "hud", "readback"
+};
+static const int g_frameTimerLatency = 4;   // frames of timer queries in flight
+static shared_ptr<FrameTimer> g_frameTimer;
+
+static void beginFramePhase(FramePhase phase) {
+	if (g_frameTimer)
+		g_frameTimer->beginPhase(phase);
+}
+
+static void endFramePhase() {
+	if (g_frameTimer)
+		g_frameTimer->endPhase();
+}
+
+// Fixed vertex attribute locations of the ShaderState programs, so a Geometry's
+// vertex layout can be baked into its VAO once for all of them
+enum VertexAttribLocation {
+	VAL_POSITION = 0,
+	VAL_NORMAL,
+	VAL_PARTICLE_POS_AGE,   // per instance
+	VAL_PARTICLE_LIFE,
+	VAL_PARTICLE_TYPE,
+	VAL_NUM_LOCATIONS
+};
+static const char * const g_vertexAttribNames[VAL_NUM_LOCATIONS] = {
+	"aPosition", "aNormal", "aParticlePosAge", "aParticleLife", "aParticleType"
+};
+
+// Uniform blocks shared by all particle programs. Each program's blocks are tied
+// to these binding points when it is built, and the buffers behind them are
+// bound once, so a frame uploads PerFrame once however many programs draw
+enum UniformBlockBinding {
+	UBB_PER_FRAME = 0,
+	UBB_PARTICLE_MATERIAL
+};
+
+// std140 layout of the PerFrame block in the particle shaders
+struct PerFrameBlock {
+	GLfloat projMatrix[16];
+	GLfloat viewMatrix[16];
+	GLfloat light[4];         // eye coordinates, vec3 padded to vec4
+	GLfloat light2[4];
+};
+
+// std140 layout of the ParticleMaterial block, which only changes at startup
+struct ParticleMaterialBlock {
+	GLfloat scale;
+	GLfloat pad[3];
+};
 
+static shared_ptr<GlBufferObject> g_perFrameUbo, g_particleMaterialUbo;
+
+// Ties a particle program's uniform blocks to their binding points, and its ramp
+// sampler to texture unit 0
+static void bindParticleProgramState(GLuint program, GLint h_uRamp) {
+	safe_glUniformBlockBinding(program, "PerFrame", UBB_PER_FRAME);
+	safe_glUniformBlockBinding(program, "ParticleMaterial", UBB_PARTICLE_MATERIAL);
+	g_glState.useProgram(program);
+	safe_glUniform1i(h_uRamp, 0);
+}
+
+// Particle programs: one sphere instance per particle, with color and opacity
+// looked up from the ramp texture by age/life and type
 struct ShaderState {
 	GlProgram program;
 
-	// Handles to uniform variables
-	GLint h_uLight, h_uLight2;
-	GLint h_uProjMatrix;
-	GLint h_uModelViewMatrix;
-	GLint h_uNormalMatrix;
-	GLint h_uColor;
-	GLint h_uTransparency;
+	// Handles to uniform variables (the rest live in the uniform blocks)
+	GLint h_uRamp;
+
+	// Vertex attributes are at the locations of VertexAttribLocation
+
+	// defines: the features to specialize the sources for, see specializeShaderSource
+	ShaderState(ProgramCache& cache, const char* vsfn, const char* fsfn, const string& defines = string()) {
+		cache.addProgram(program, vsfn, fsfn, VAL_NUM_LOCATIONS, g_vertexAttribNames, defines);
+	}
+
+	// once the cache has finished the program
+	void init() {
+		const GLuint h = program; // short hand
+
+								  // Retrieve handles to uniform variables
+		h_uRamp = safe_glGetUniformLocation(h, "uRamp");
+
+		bindParticleProgramState(h, h_uRamp);
+		checkGlErrors();
+	}
+
+};
+
+// Program used by PB_CLOSED_FORM: the vertex shader reconstructs each particle's
+// position, age and life from its base state and the current step
+struct ClosedFormShaderState {
+	GlProgram program;
+
+	// Handles to uniform variables (the rest live in the uniform blocks)
+	GLint h_uStep, h_uAgeStep, h_uForceStep;
+	GLint h_uRamp;
 
 	// Handles to vertex attributes
 	GLint h_aPosition;
 	GLint h_aNormal;
+	GLint h_aBasePos, h_aBaseVel, h_aBaseParams; // per instance
 
-	ShaderState(const char* vsfn, const char* fsfn) {
-		readAndCompileShader(program, vsfn, fsfn);
+	ClosedFormShaderState(ProgramCache& cache, const char* vsfn, const char* fsfn) {
+		cache.addProgram(program, vsfn, fsfn);
+	}
 
+	// once the cache has finished the program
+	void init() {
 		const GLuint h = program; // short hand
 
-								  // Retrieve handles to uniform variables
-		h_uLight = safe_glGetUniformLocation(h, "uLight");
-		h_uLight2 = safe_glGetUniformLocation(h, "uLight2");
-		h_uTransparency = safe_glGetUniformLocation(h, "uTransparency");
-		h_uProjMatrix = safe_glGetUniformLocation(h, "uProjMatrix");
-		h_uModelViewMatrix = safe_glGetUniformLocation(h, "uModelViewMatrix");
-		h_uNormalMatrix = safe_glGetUniformLocation(h, "uNormalMatrix");
-		h_uColor = safe_glGetUniformLocation(h, "uColor");
-
-		// Retrieve handles to vertex attributes
+		h_uStep = safe_glGetUniformLocation(h, "uStep");
+		h_uAgeStep = safe_glGetUniformLocation(h, "uAgeStep");
+		h_uForceStep = safe_glGetUniformLocation(h, "uForceStep");
+		h_uRamp = safe_glGetUniformLocation(h, "uRamp");
+
 		h_aPosition = safe_glGetAttribLocation(h, "aPosition");
 		h_aNormal = safe_glGetAttribLocation(h, "aNormal");
+		h_aBasePos = safe_glGetAttribLocation(h, "aBasePos");
+		h_aBaseVel = safe_glGetAttribLocation(h, "aBaseVel");
+		h_aBaseParams = safe_glGetAttribLocation(h, "aBaseParams");
+
+		bindParticleProgramState(h, h_uRamp);
+		safe_glUniform1f(h_uAgeStep, g_ageStep);
+		safe_glUniform2f(h_uForceStep, g_fireForceStep, g_smokeForceStep);
+		checkGlErrors();
+	}
+};
+
+static const char * const g_closedFormShaderFiles[2] =
+	{ "./shaders/particle-closedform-gl3.vshader", "./shaders/particle-gl3.fshader" };
+static shared_ptr<ClosedFormShaderState> g_closedFormShaderState;
+
+#ifndef __MAC__
+// Compute program used by PB_COMPUTE to advance every particle by one step
+struct ParticleUpdateShaderState {
+	GlProgram program;
+
+	// Handles to uniform variables
+	GLint h_uCount;
+	GLint h_uAgeStep, h_uForceStep;
+
+	ParticleUpdateShaderState(ProgramCache& cache, const char* csfn) {
+		cache.addComputeProgram(program, csfn);
+	}
+
+	// once the cache has finished the program
+	void init() {
+		const GLuint h = program; // short hand
+
+		h_uCount = safe_glGetUniformLocation(h, "uCount");
+		h_uAgeStep = safe_glGetUniformLocation(h, "uAgeStep");
+		h_uForceStep = safe_glGetUniformLocation(h, "uForceStep");
+		checkGlErrors();
+	}
+};
+
+static const char * const g_particleUpdateShaderFile = "./shaders/particle-update-gl4.cshader";
+static const int g_particleUpdateGroupSize = 64; // local_size_x of the compute shader
+static shared_ptr<ParticleUpdateShaderState> g_particleUpdateShaderState;
+
+// Compute program used by PB_COMPUTE to frustum cull particles into an indirect draw
+struct ParticleCullShaderState {
+	GlProgram program;
+
+	// Handles to uniform variables
+	GLint h_uCount;
+	GLint h_uFrustum;
+	GLint h_uRadius;
+
+	ParticleCullShaderState(ProgramCache& cache, const char* csfn) {
+		cache.addComputeProgram(program, csfn);
+	}
+
+	// once the cache has finished the program
+	void init() {
+		const GLuint h = program; // short hand
 
-		if (!g_Gl2Compatible)
-			glBindFragDataLocation(h, 0, "fragColor");
+		h_uCount = safe_glGetUniformLocation(h, "uCount");
+		h_uFrustum = safe_glGetUniformLocation(h, "uFrustum");
+		h_uRadius = safe_glGetUniformLocation(h, "uRadius");
 		checkGlErrors();
 	}
+};
+
+static const char * const g_particleCullShaderFile = "./shaders/particle-cull-gl4.cshader";
+static shared_ptr<ParticleCullShaderState> g_particleCullShaderState;
+#endif
+
+static string g_shaderCacheDir = "shadercache";  // program binaries; empty to always compile
+
+// Features the sphere programs are specialized for at compile time, so that
+// each draw binds a program with no branch on them: every combination is one
+// variant, built from the same sources with a #define per feature bit
+enum ParticleFeature {
+	PF_BILLBOARD = 1,       // the mesh is a quad kept facing the eye
+	PF_SOLID = 2,           // full opacity ('f')
+	PF_NUM_VARIANTS = 4
+};
+static const int g_numParticleFeatures = 2;
+static const char * const g_particleFeatureNames[g_numParticleFeatures] = { "BILLBOARD", "SOLID" };
+
+static const char * const g_shaderFiles[2] = {
+	"./shaders/particle-gl3.vshader", "./shaders/particle-gl3.fshader"
+};
+static vector<shared_ptr<ShaderState> > g_shaderStates; // our global shader states, by ParticleFeature bits
+
+// The sphere program for the current settings
+static const ShaderState& particleShaderState(bool billboard) {
+	return *g_shaderStates[(g_activeShader ? PF_SOLID : 0) | (billboard ? PF_BILLBOARD : 0)];
+}
+
+// Particles as quads that ray-cast their sphere per fragment
+static const char * const g_impostorShaderFiles[2] = {
+	"./shaders/particle-impostor-gl3.vshader", "./shaders/impostor-gl3.fshader"
+};
+static shared_ptr<ShaderState> g_impostorShaderState;
 
+// Particles as quads showing flipbook frames from the sprite atlas
+static const char * const g_spriteShaderFiles[2] = {
+	"./shaders/particle-sprite-gl3.vshader", "./shaders/sprite-gl3.fshader"
 };
+static shared_ptr<ShaderState> g_spriteShaderState;
 
-static const int g_numShaders = 2;
-static const char * const g_shaderFiles[g_numShaders][2] = {
-	{ "./shaders/basic-gl3.vshader", "./shaders/diffuse-gl3.fshader" },
-	{ "./shaders/basic-gl3.vshader", "./shaders/solid-gl3.fshader" }
+// Color (top row) and opacity (bottom row) over age/life, one file per particle type
+static const int g_numRamps = 2;
+static const char * const g_rampFiles[g_numRamps] = {
+	"./textures/fire-ramp.ppm",
+	"./textures/smoke-ramp.ppm"
 };
-static const char * const g_shaderFilesGl2[g_numShaders][2] = {
-	{ "./shaders/basic-gl2.vshader", "./shaders/diffuse-gl2.fshader" },
-	{ "./shaders/basic-gl2.vshader", "./shaders/solid-gl2.fshader" }
+static shared_ptr<GlTexture> g_rampTexture;       // 1D array texture, layer = particle type
+
+// Flipbook frames over age/life, color above opacity, for each particle type in
+// the order of the ramps
+static const int g_numSpriteFrames = 4;  // per particle type
+static const char * const g_spriteFiles[g_numRamps * g_numSpriteFrames] = {
+	"./textures/fire-sprite-0.ppm", "./textures/fire-sprite-1.ppm",
+	"./textures/fire-sprite-2.ppm", "./textures/fire-sprite-3.ppm",
+	"./textures/smoke-sprite-0.ppm", "./textures/smoke-sprite-1.ppm",
+	"./textures/smoke-sprite-2.ppm", "./textures/smoke-sprite-3.ppm"
 };
-static vector<shared_ptr<ShaderState> > g_shaderStates; // our global shader states
+static shared_ptr<GlTexture> g_spriteTexture;     // atlas of every frame, on texture unit 1
 
 														// --------- Geometry
 
 														// Macro used to obtain relative offset of a field within a struct
 #define FIELD_OFFSET(StructType, field) &(((StructType *)0)->field)
 
-														// A vertex with floating point position and normal
+														// A vertex with half float position and a normal packed 10 bits per
+														// component (GL_INT_2_10_10_10_REV): 12 bytes instead of 24 as floats
 struct VertexPN {
-	Cvec3f p, n;
+	GLhalf p[4];     // x, y, z, and 1 to keep n aligned
+	GLuint n;
+
+	// the GenericVertex attributes make* functions need to fill in
+	static const unsigned attribs = GV_POSITION | GV_NORMAL;
 
 	VertexPN() {}
 	VertexPN(float x, float y, float z,
 		float nx, float ny, float nz)
-		: p(x, y, z), n(nx, ny, nz)
-	{}
+	{
+		set(Cvec3f(x, y, z), Cvec3f(nx, ny, nz));
+	}
 
 	// Define copy constructor and assignment operator from GenericVertex so we can
 	// use make* functions from geometrymaker.h
@@ -125,76 +376,224 @@ struct VertexPN {
 	}
 
 	VertexPN& operator = (const GenericVertex& v) {
-		p = v.pos;
-		n = v.normal;
+		set(v.pos, v.normal);
 		return *this;
 	}
+
+	void set(const Cvec3f& pos, const Cvec3f& normal) {
+		for (int i = 0; i < 3; ++i)
+			p[i] = packHalf(pos[i]);
+		p[3] = packHalf(1);
+		n = packSnorm1010102(normal[0], normal[1], normal[2]);
+	}
+};
+
+// Where the per-instance attributes of ShaderState live in an instance buffer
+struct InstanceStream {
+	GLuint vbo;
+	GLsizei stride;
+	const GLvoid *posAge, *life, *type; // offsets of the fields within a record
+};
+
+// Layout of the parameters read by glDrawElementsIndirect
+struct DrawElementsIndirectCommand {
+	GLuint count;
+	GLuint instanceCount;
+	GLuint firstIndex;
+	GLint baseVertex;
+	GLuint baseInstance;
 };
 
+// Static meshes are packed into two arenas read through one VAO, so any mesh is
+// drawn by binding that VAO and giving its index range and base vertex
+static const GLsizeiptr g_vertexArenaSize = 1 << 20;
+static const GLsizeiptr g_indexArenaSize = 1 << 18;
+static shared_ptr<GlBufferArena> g_vertexArena, g_indexArena;
+static shared_ptr<GlArrayObject> g_meshVao;
+
+// The instance stream the mesh VAO's instance attributes point at, if any
+static bool g_meshVaoInstanced = false;
+static InstanceStream g_meshVaoInstances;
+
+// Create the arenas and bake the mesh vertex layout into the VAO, before any Geometry
+static void initMeshArenas() {
+	g_vertexArena.reset(new GlBufferArena(g_vertexArenaSize));
+	g_indexArena.reset(new GlBufferArena(g_indexArenaSize));
+
+	g_meshVao.reset(new GlArrayObject);
+	g_glState.bindVertexArray(*g_meshVao);
+	g_glState.bindBuffer(GL_ARRAY_BUFFER, *g_vertexArena);
+	glEnableVertexAttribArray(VAL_POSITION);
+	glEnableVertexAttribArray(VAL_NORMAL);
+	glVertexAttribPointer(VAL_POSITION, 3, GL_HALF_FLOAT, GL_FALSE, sizeof(VertexPN), FIELD_OFFSET(VertexPN, p));
+	glVertexAttribPointer(VAL_NORMAL, 4, GL_INT_2_10_10_10_REV, GL_TRUE, sizeof(VertexPN), FIELD_OFFSET(VertexPN, n));
+	g_glState.bindBuffer(GL_ELEMENT_ARRAY_BUFFER, *g_indexArena);
+	checkGlErrors();
+}
+
+// Bind the mesh VAO with its instance attributes reading the given stream
+static void bindMeshVaoInstanced(const InstanceStream& instances) {
+	g_glState.bindVertexArray(*g_meshVao);
+
+	// enabled on first use, as an enabled attribute needs a buffer
+	if (!g_meshVaoInstanced) {
+		for (int l = VAL_PARTICLE_POS_AGE; l <= VAL_PARTICLE_TYPE; ++l) {
+			glEnableVertexAttribArray(l);
+			glVertexAttribDivisor(l, 1);   // advance once per instance
+		}
+	}
+	else if (instances.vbo == g_meshVaoInstances.vbo && instances.stride == g_meshVaoInstances.stride &&
+		instances.posAge == g_meshVaoInstances.posAge && instances.life == g_meshVaoInstances.life &&
+		instances.type == g_meshVaoInstances.type) {
+		g_glState.countSkipped(4);
+		return;
+	}
+
+	// point the instance attributes at the stream
+	g_glState.bindBuffer(GL_ARRAY_BUFFER, instances.vbo);
+	glVertexAttribPointer(VAL_PARTICLE_POS_AGE, 4, GL_FLOAT, GL_FALSE, instances.stride, instances.posAge);
+	glVertexAttribPointer(VAL_PARTICLE_LIFE, 1, GL_FLOAT, GL_FALSE, instances.stride, instances.life);
+	glVertexAttribPointer(VAL_PARTICLE_TYPE, 1, GL_FLOAT, GL_FALSE, instances.stride, instances.type);
+	g_meshVaoInstanced = true;
+	g_meshVaoInstances = instances;
+}
+
+// A mesh living in g_vertexArena and g_indexArena
 struct Geometry {
-	GlBufferObject vbo, ibo;
-	GlArrayObject vao;
+	GLint baseVertex;     // index of its first vertex in g_vertexArena
+	GLuint firstIndex;    // index of its first index in g_indexArena
 	int vboLen, iboLen;
 
 	Geometry(VertexPN *vtx, unsigned short *idx, int vboLen, int iboLen) {
 		this->vboLen = vboLen;
 		this->iboLen = iboLen;
 
-		// Now create the VBO and IBO
-		glBindBuffer(GL_ARRAY_BUFFER, vbo);
-		glBufferData(GL_ARRAY_BUFFER, sizeof(VertexPN) * vboLen, vtx, GL_STATIC_DRAW);
+		baseVertex = g_vertexArena->upload(vtx, sizeof(VertexPN) * vboLen, sizeof(VertexPN)) / sizeof(VertexPN);
+		firstIndex = g_indexArena->upload(idx, sizeof(unsigned short) * iboLen, sizeof(unsigned short)) / sizeof(unsigned short);
+	}
+
+	// A mesh already written into the arenas, e.g. through GlArenaMapping
+	Geometry(GLint baseVertex, GLuint firstIndex, int vboLen, int iboLen)
+		: baseVertex(baseVertex), firstIndex(firstIndex), vboLen(vboLen), iboLen(iboLen)
+	{}
 
-		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, ibo);
-		glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(unsigned short) * iboLen, idx, GL_STATIC_DRAW);
+	// Where the indices start, as the glDrawElements calls take it
+	const GLvoid *indexOffset() const {
+		return (const GLvoid *)(sizeof(unsigned short) * firstIndex);
 	}
 
-	void draw(const ShaderState& curSS) {
-		// bind the object's VAO
-		glBindVertexArray(vao);
+	// The indirect draw of instanceCount instances from record baseInstance on
+	DrawElementsIndirectCommand indirectCommand(GLuint instanceCount, GLuint baseInstance) const {
+		DrawElementsIndirectCommand command;
+		command.count = iboLen;
+		command.instanceCount = instanceCount;
+		command.firstIndex = firstIndex;
+		command.baseVertex = baseVertex;
+		command.baseInstance = baseInstance;
+		return command;
+	}
 
-		// Enable the attributes used by our shader
-		safe_glEnableVertexAttribArray(curSS.h_aPosition);
-		safe_glEnableVertexAttribArray(curSS.h_aNormal);
+	void draw() {
+		g_glState.bindVertexArray(*g_meshVao);
 
-		// bind vbo
-		glBindBuffer(GL_ARRAY_BUFFER, vbo);
-		safe_glVertexAttribPointer(curSS.h_aPosition, 3, GL_FLOAT, GL_FALSE, sizeof(VertexPN), FIELD_OFFSET(VertexPN, p));
-		safe_glVertexAttribPointer(curSS.h_aNormal, 3, GL_FLOAT, GL_FALSE, sizeof(VertexPN), FIELD_OFFSET(VertexPN, n));
+		// draw!
+		glDrawElementsBaseVertex(GL_TRIANGLES, iboLen, GL_UNSIGNED_SHORT, indexOffset(), baseVertex);
+	}
 
-		// bind ibo
-		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, ibo);
+	// Draw instanceCount copies of the geometry, one per record of the instance stream
+	void drawInstanced(const InstanceStream& instances, int instanceCount) {
+		bindMeshVaoInstanced(instances);
 
 		// draw!
-		glDrawElements(GL_TRIANGLES, iboLen, GL_UNSIGNED_SHORT, 0);
+		glDrawElementsInstancedBaseVertex(GL_TRIANGLES, iboLen, GL_UNSIGNED_SHORT, indexOffset(), instanceCount, baseVertex);
+	}
 
-		// Disable the attributes used by our shader
-		safe_glDisableVertexAttribArray(curSS.h_aPosition);
-		safe_glDisableVertexAttribArray(curSS.h_aNormal);
+	// Same as drawInstanced, with the instance count read from a buffer written on
+	// the GPU. The command there must be this mesh's indirectCommand
+	void drawIndirect(const InstanceStream& instances, GLuint commandBuffer) {
+		bindMeshVaoInstanced(instances);
 
-		// disable VAO
-		glBindVertexArray(NULL);
+		// draw!
+		g_glState.bindBuffer(GL_DRAW_INDIRECT_BUFFER, commandBuffer);
+		glDrawElementsIndirect(GL_TRIANGLES, GL_UNSIGNED_SHORT, 0);
 	}
 };
 
 struct Particle {
 	RigTForm rbt;
 	Cvec3 velocity; //velocity
-	Cvec3 color;    //color
 	Cvec3 gravitational_force;
 	float life;
 	float age;
 	float scale;
 	int type; //0 or 1, either fire(0) or smoke(1)
-	shared_ptr<Geometry> sphere;
 };
 
 Particle particles[MaxParticles];
 
+// Single precision copy of a Cvec3, for data headed to GL buffers
+static Cvec3f toCvec3f(const Cvec3& v) {
+	return Cvec3f(v[0], v[1], v[2]);
+}
+
+// Per-instance record uploaded every frame by the CPU backend
+struct ParticleInstance {
+	Cvec3f pos;
+	float age;
+	float life;
+	float type;
+};
+
+static vector<ParticleInstance> g_particleInstances(MaxParticles);
+static shared_ptr<GlBufferObject> g_particleInstanceVbo;
+#ifndef __MAC__
+// when available, instances are written straight into this instead of being
+// copied into g_particleInstanceVbo
+static shared_ptr<GlStreamRing> g_particleInstanceRing;
+#endif
+
+// Particle centers in single precision, one array per coordinate, for cullSpheres
+static vector<float> g_particleX(MaxParticles), g_particleY(MaxParticles), g_particleZ(MaxParticles);
+static vector<int> g_visibleParticles(MaxParticles);
+static vector<unsigned char> g_visibleLods(MaxParticles);
+static long g_culledSinceReport = 0, g_drawnSinceReport = 0;
+
 
 
 // Vertex buffer and index buffer associated with the ground and cube geometry and sphere
 static shared_ptr<Geometry> g_ground, g_sphere;
 
+// Particle sphere levels of detail, finest first. A particle uses the first level
+// whose minimum radius its projection reaches; the last level is a camera facing quad
+enum SphereMesh {
+	SM_ICOSPHERE,
+	SM_OCTASPHERE,
+	SM_BILLBOARD
+};
+
+struct SphereLod {
+	SphereMesh mesh;
+	int subdivisions;
+	float minPixelRadius;
+};
+
+// subdivided solids need about half the triangles of the slice and stack spheres
+// with the same silhouettes (80, 20 and 8 here against 128, 32 and 12)
+static const int g_numSphereLods = 4;
+static const int g_defaultSphereLod = 1;  // level used without LOD, and by the other backends
+static const SphereLod g_sphereLods[g_numSphereLods] = {
+	{ SM_ICOSPHERE, 1, 8.0 },
+	{ SM_ICOSPHERE, 0, 3.0 },
+	{ SM_OCTASPHERE, 0, 1.5 },
+	{ SM_BILLBOARD, 0, 0.0 }
+};
+static shared_ptr<Geometry> g_sphereLodGeometry[g_numSphereLods];
+static shared_ptr<Geometry> g_particleQuad;  // the billboard level, also used by the impostors
+#ifndef __MAC__
+static shared_ptr<GlBufferObject> g_lodCommandBuffer;  // sphere level draws, with multi-draw indirect
+#endif
+static long g_lodDrawnSinceReport[g_numSphereLods];
+
 // --------- Scene
 static const Cvec3 g_light1(2.0, 3.0, 14.0), g_light2(-2, -3.0, -5.0);  // define two lights positions in world space
 static RigTForm g_skyRbt = RigTForm(Cvec3(0.0, 3.0, 20.0));
@@ -229,8 +628,6 @@ void initParticleAttributes(Particle *particles)
 		particles->velocity[1] = ((((((5) * rand() % 11) + 5)) * rand() % 11) + 1) * 0.02;
 		particles->velocity[2] = (((((((2) * rand() % 11) + 1)) * rand() % 11) + 1) * 0.007) - (((((((2) * rand() % 11) + 1)) * rand() % 5) + 1) * 0.007);
 
-		particles->color = Cvec3(1.0, 0.95, 0.8);
-
 		particles->gravitational_force = Cvec3(0.0, 0.0, 0.0);
 	}
 	else
@@ -242,60 +639,156 @@ void initParticleAttributes(Particle *particles)
 		particles->velocity[0] = (((((((2) * rand() % 11) + 1)) * rand() % 11) + 1) * 0.007) - (((((((2) * rand() % 11) + 1)) * rand() % 11) + 1) * 0.007);
 		particles->velocity[1] = ((((((5) * rand() % 11) + 5)) * rand() % 11) + 1) * 0.02;
 		particles->velocity[2] = (((((((2) * rand() % 11) + 1)) * rand() % 11) + 1) * 0.007) - (((((((2) * rand() % 11) + 1)) * rand() % 5) + 1) * 0.007);
-
-		particles->color = Cvec3(1.0, 0.95, 0.8);
 	}
 
 
 }
 
+template<typename VtxOutIter, typename IdxOutIter>
+static void makeSphereLod(const SphereLod& lod, VtxOutIter vtxIter, IdxOutIter idxIter, unsigned attribs) {
+	if (lod.mesh == SM_ICOSPHERE)
+		makeIcosphere(g_particleRadius, lod.subdivisions, vtxIter, idxIter, attribs);
+	else
+		makeOctasphere(g_particleRadius, lod.subdivisions, vtxIter, idxIter, attribs);
+}
+
+// Generates a sphere level into the arenas with its triangles reordered for the
+// post-transform vertex cache and its vertices in order of first use. The indices
+// are made and optimized first, then the vertices written straight to their new
+// places in the mapped arena
+static shared_ptr<Geometry> makeOptimizedSphere(const SphereLod& lod) {
+	int ibLen, vbLen;
+	if (lod.mesh == SM_ICOSPHERE)
+		getIcosphereVbIbLen(lod.subdivisions, vbLen, ibLen);
+	else
+		getOctasphereVbIbLen(lod.subdivisions, vbLen, ibLen);
+	vector<unsigned short> idx(ibLen);
+	makeSphereLod(lod, DiscardOutputIter(), idx.begin(), 0);
+
+	const double acmrBefore = computeAcmr(&idx[0], ibLen, vbLen);
+	optimizeVertexCache(&idx[0], ibLen, vbLen);
+	vector<int> remap;
+	const int usedLen = optimizeVertexFetch(&idx[0], ibLen, vbLen, remap);
+	cout << (lod.mesh == SM_ICOSPHERE ? "Icosphere " : "Octasphere ") << lod.subdivisions
+		<< " (" << ibLen / 3 << " triangles): ACMR " << acmrBefore
+		<< " -> " << computeAcmr(&idx[0], ibLen, usedLen) << endl;
+
+	GlArenaMapping<VertexPN> vtxMap(*g_vertexArena, usedLen);
+	GlArenaMapping<unsigned short> idxMap(*g_indexArena, ibLen);
+	makeSphereLod(lod, RemapOutputIter<VertexPN>(vtxMap.begin(), &remap[0]), DiscardOutputIter(), VertexPN::attribs);
+	copy(idx.begin(), idx.end(), idxMap.begin());
+	return shared_ptr<Geometry>(new Geometry(vtxMap.first(), idxMap.first(), usedLen, ibLen));
+}
+
 static void initParticles() {
+	// every particle is an instance of one of the sphere levels of detail
+	for (int l = 0; l < g_numSphereLods; ++l) {
+		const SphereLod& lod = g_sphereLods[l];
+		if (lod.mesh != SM_BILLBOARD)
+			g_sphereLodGeometry[l] = makeOptimizedSphere(lod);
+		else {
+			// the billboard is a square in x-y facing +z
+			const float h = g_particleRadius;
+			VertexPN quad[4] = {
+				VertexPN(-h,  h, 0, 0, 0, 1),
+				VertexPN(-h, -h, 0, 0, 0, 1),
+				VertexPN( h, -h, 0, 0, 0, 1),
+				VertexPN( h,  h, 0, 0, 0, 1)
+			};
+			unsigned short quadIdx[6] = { 0, 1, 2, 0, 2, 3 };
+			g_sphereLodGeometry[l].reset(new Geometry(quad, quadIdx, 4, 6));
+		}
+	}
+	g_sphere = g_sphereLodGeometry[g_defaultSphereLod];
+	g_particleQuad = g_sphereLodGeometry[g_numSphereLods - 1];
+#ifndef __MAC__
+	// base instances in indirect commands need 4.2, multi-draw indirect 4.3
+	if (GLEW_VERSION_4_3)
+		g_lodCommandBuffer.reset(new GlBufferObject);
+#endif
+
 	for (int i = 0; i < MaxParticles; i++) {
 		//physics
 		initParticleAttributes(&particles[i]);
+	}
+
+	g_particleInstanceVbo.reset(new GlBufferObject);
+#ifndef __MAC__
+	if (GlStreamRing::isSupported())
+		g_particleInstanceRing.reset(new GlStreamRing(sizeof(ParticleInstance) * MaxParticles));
+#endif
+}
 
-		//geometry
-		int ibLen, vbLen;
-		getSphereVbIbLen(4, 4, vbLen, ibLen);
+// Creates the uniform buffers behind the shared blocks and binds them to their
+// binding points for good
+static void initUniformBlocks() {
+	g_perFrameUbo.reset(new GlBufferObject);
+	g_glState.bindBuffer(GL_UNIFORM_BUFFER, *g_perFrameUbo);
+	glBufferData(GL_UNIFORM_BUFFER, sizeof(PerFrameBlock), NULL, GL_DYNAMIC_DRAW);
+	g_glState.bindBufferBase(GL_UNIFORM_BUFFER, UBB_PER_FRAME, *g_perFrameUbo);
+
+	ParticleMaterialBlock material = {};  // padding zeroed
+	material.scale = g_particleScale;
+	g_particleMaterialUbo.reset(new GlBufferObject);
+	g_glState.bindBuffer(GL_UNIFORM_BUFFER, *g_particleMaterialUbo);
+	glBufferData(GL_UNIFORM_BUFFER, sizeof(material), &material, GL_STATIC_DRAW);
+	g_glState.bindBufferBase(GL_UNIFORM_BUFFER, UBB_PARTICLE_MATERIAL, *g_particleMaterialUbo);
+	checkGlErrors();
+}
 
-		vector<VertexPN> vtx(vbLen);
-		vector<unsigned short> idx(ibLen);
-		makeSphere(7, 4, 4, vtx.begin(), idx.begin());
-		//makeSphere(10, 5, 5, vtx.begin(), idx.begin());
-		particles[i].sphere.reset(new Geometry(&vtx[0], &idx[0], vtx.size(), idx.size()));
+// takes the projection matrix and the eye's inverse RBT and sends them, with the
+// lights in eye coordinates, to every program at once
+static void sendPerFrameBlock(const Matrix4& projMatrix, const RigTForm& invEyeRbt) {
+	PerFrameBlock block;
+	projMatrix.writeToColumnMajorMatrix(block.projMatrix);
+	rigTFormToMatrix(invEyeRbt).writeToColumnMajorMatrix(block.viewMatrix);
 
+	const Cvec3 eyeLight1 = Cvec3(invEyeRbt * Cvec4(g_light1, 1)); // g_light1 position in eye coordinates
+	const Cvec3 eyeLight2 = Cvec3(invEyeRbt * Cvec4(g_light2, 1)); // g_light2 position in eye coordinates
+	for (int i = 0; i < 3; ++i) {
+		block.light[i] = eyeLight1[i];
+		block.light2[i] = eyeLight2[i];
 	}
-}
+	block.light[3] = block.light2[3] = 1;
 
-// takes a projection matrix and send to the the shaders
-static void sendProjectionMatrix(const ShaderState& curSS, const Matrix4& projMatrix) {
-	GLfloat glmatrix[16];
-	projMatrix.writeToColumnMajorMatrix(glmatrix); // send projection matrix
-	safe_glUniformMatrix4fv(curSS.h_uProjMatrix, glmatrix);
+	g_glState.bindBuffer(GL_UNIFORM_BUFFER, *g_perFrameUbo);
+	glBufferSubData(GL_UNIFORM_BUFFER, 0, sizeof(block), &block);
 }
 
-// takes MVM and its normal matrix to the shaders
-static void sendModelViewNormalMatrix(const ShaderState& curSS, const Matrix4& MVM, const Matrix4& NMVM) {
-	GLfloat glmatrix[16];
-	MVM.writeToColumnMajorMatrix(glmatrix); // send MVM
-	safe_glUniformMatrix4fv(curSS.h_uModelViewMatrix, glmatrix);
-
-	NMVM.writeToColumnMajorMatrix(glmatrix); // send NMVM
-	safe_glUniformMatrix4fv(curSS.h_uNormalMatrix, glmatrix);
+// FOV in y direction that keeps at least g_frustMinFov in both directions for
+// an image of the given size
+static double frustFovY(const int width, const int height) {
+	if (width >= height)
+		return g_frustMinFov;
+	const double RAD_PER_DEG = 0.5 * CS175_PI / 180;
+	return atan2(sin(g_frustMinFov * RAD_PER_DEG) * height / width, cos(g_frustMinFov * RAD_PER_DEG)) / RAD_PER_DEG;
 }
 
 // update g_frustFovY from g_frustMinFov, g_windowWidth, and g_windowHeight
 static void updateFrustFovY() {
-	if (g_windowWidth >= g_windowHeight)
-		g_frustFovY = g_frustMinFov;
-	else {
-		const double RAD_PER_DEG = 0.5 * CS175_PI / 180;
-		g_frustFovY = atan2(sin(g_frustMinFov * RAD_PER_DEG) * g_windowHeight / g_windowWidth, cos(g_frustMinFov * RAD_PER_DEG)) / RAD_PER_DEG;
-	}
+	g_frustFovY = frustFovY(g_windowWidth, g_windowHeight);
 }
 
+// While a poster is drawn, the frame is one tile of it: the pixels [x0, x1) x
+// [y0, y1), rows counted from the top, of a width x height image
+struct PosterTile {
+	int width, height;
+	int x0, y0, x1, y1;
+};
+static const PosterTile *g_posterTile = NULL;
+
 static Matrix4 makeProjectionMatrix() {
-	return Matrix4::makeProjection(g_frustFovY, g_windowWidth / static_cast <double> (g_windowHeight), g_frustNear, g_frustFar);
+	if (!g_posterTile)
+		return Matrix4::makeProjection(g_frustFovY, g_windowWidth / static_cast <double> (g_windowHeight), g_frustNear, g_frustFar);
+
+	// the tile's part of the poster's rectangle on the near plane
+	const PosterTile& t = *g_posterTile;
+	const double top = -g_frustNear * tan(0.5 * frustFovY(t.width, t.height) * CS175_PI / 180);
+	const double right = top * t.width / t.height;
+	return Matrix4::makeProjection(
+		top - 2 * top * t.y0 / t.height, top - 2 * top * t.y1 / t.height,
+		-right + 2 * right * t.x0 / t.width, -right + 2 * right * t.x1 / t.width,
+		g_frustNear, g_frustFar);
 }
 
 void Smoke_conversion(Particle *particles)
@@ -307,86 +800,651 @@ void Smoke_conversion(Particle *particles)
 	particles->velocity[0] = (((((((2) * rand() % 11) + 1)) * rand() % 11) + 1) * 0.0035) - (((((((2) * rand() % 11) + 1)) * rand() % 11) + 1) * 0.0035);
 	particles->velocity[1] = ((((((5) * rand() % 11) + 3)) * rand() % 11) + 7) * 0.015;
 	particles->velocity[2] = (((((((2) * rand() % 11) + 1)) * rand() % 11) + 1) * 0.0015) - (((((((2) * rand() % 11) + 1)) * rand() % 11) + 1) * 0.0015);
+}
+
+// Advance a particle by one simulation step: age, position and upward force
+static void integrateParticle(Particle *p)
+{
+	//update age
+	p->age = p->age + g_ageStep;
+
+	//update position
+	p->rbt.setTranslation(p->rbt.getTranslation() + p->velocity + p->gravitational_force);
+
+	//update gravitational force
+	p->gravitational_force[1] += (p->type == 0) ? g_fireForceStep : g_smokeForceStep;
+}
+
+// "dead or alive" status of a particle: too old, or left its bounding region
+static bool isParticleDead(const Particle *p)
+{
+	const Cvec3 t = p->rbt.getTranslation();
+	if (p->type == 0)
+		return p->age > p->life || t[1] > 35 || t[1] < -25 || t[0] > 40 || t[0] < -40;
+	else
+		return p->age > p->life || t[1] > 45 || t[1] < -35 || t[0] > 80 || t[0] < -80;
+}
 
-	particles->color = Cvec3(0.6, 0.6, 0.6);
+// Dead fire turns into smoke 10% of the time and is otherwise reborn as fire;
+// dead smoke is always reborn as fire
+static void respawnParticle(Particle *p)
+{
+	if (p->type == 0)
+	{
+		int prob = rand() % 100;
+		if (prob < 10)
+		{
+			Smoke_conversion(p);
+		}
+		else
+		{
+			initParticleAttributes(p);
+		}
+	}
+	else
+	{
+		p->type = 0;
+		initParticleAttributes(p);
+	}
 }
 
 void updateParticles()
 {
 	for (int i = 0; i < MaxParticles; i++)
 	{
-		//update age
-		particles[i].age = particles[i].age + 0.02;
+		integrateParticle(&particles[i]);
 
-		//update position
-		particles[i].rbt.setTranslation(particles[i].rbt.getTranslation() + particles[i].velocity + particles[i].gravitational_force);
+		if (isParticleDead(&particles[i]))
+			respawnParticle(&particles[i]);
+	}
 
-		//update gravitational force
+}
 
-		if (particles[i].type == 0)
-		{
-			particles[i].gravitational_force[1] += 0.005;
+// Level of detail for a sphere of the particle radius whose center is at clip
+// space depth w, given the projection matrix
+static int pickSphereLod(const Matrix4& projmat, double w) {
+	if (w <= 0)
+		return 0;
+	const double pixelRadius = g_particleRadius * g_particleScale * projmat(1, 1) * g_windowHeight * 0.5 / w;
+	int l = 0;
+	while (l < g_numSphereLods - 1 && pixelRadius < g_sphereLods[l].minPixelRadius)
+		++l;
+	return l;
+}
+
+// Copy the particles inside the view frustum (or all of them, with culling off)
+// into the instance buffer for this frame's draw, grouped by level of detail:
+// level l occupies lodCount[l] records starting at record lodFirst[l]. With the
+// stream ring, this opens a region that must be closed after the draws.
+static void uploadParticleInstances(const Matrix4& projmat, const Matrix4& projView, InstanceStream& stream,
+	int lodFirst[g_numSphereLods], int lodCount[g_numSphereLods])
+{
+	int numVisible;
+	if (g_cullParticles) {
+		for (int i = 0; i < MaxParticles; i++) {
+			const Cvec3 t = particles[i].rbt.getTranslation();
+			g_particleX[i] = t[0];
+			g_particleY[i] = t[1];
+			g_particleZ[i] = t[2];
 		}
-		else
-		{
-			particles[i].gravitational_force[1] += 0.0005;
+		numVisible = cullSpheres(makeFrustum(projView), &g_particleX[0], &g_particleY[0], &g_particleZ[0],
+			MaxParticles, g_particleRadius * g_particleScale, &g_visibleParticles[0]);
+	}
+	else {
+		for (int i = 0; i < MaxParticles; i++)
+			g_visibleParticles[i] = i;
+		numVisible = MaxParticles;
+	}
+
+	// bin the visible particles by level of detail (a counting sort)
+	for (int l = 0; l < g_numSphereLods; ++l)
+		lodCount[l] = 0;
+	for (int v = 0; v < numVisible; v++) {
+		int l = g_defaultSphereLod;
+		if (g_particleLod && !g_particleImpostors && !g_particleSprites) {
+			const Cvec3 t = particles[g_visibleParticles[v]].rbt.getTranslation();
+			const double w = projView(3, 0) * t[0] + projView(3, 1) * t[1] + projView(3, 2) * t[2] + projView(3, 3);
+			l = pickSphereLod(projmat, w);
 		}
+		g_visibleLods[v] = l;
+		++lodCount[l];
+	}
+	int next[g_numSphereLods];
+	for (int l = 0, first = 0; l < g_numSphereLods; ++l) {
+		lodFirst[l] = next[l] = first;
+		first += lodCount[l];
+	}
 
+	ParticleInstance *out = &g_particleInstances[0];
+	GLintptr base = 0;
+#ifndef __MAC__
+	if (g_particleInstanceRing) {
+		out = (ParticleInstance *)g_particleInstanceRing->beginRegion();
+		base = g_particleInstanceRing->regionOffset();
+	}
+#endif
+	for (int v = 0; v < numVisible; v++) {
+		const Particle& p = particles[g_visibleParticles[v]];
+		ParticleInstance& inst = out[next[g_visibleLods[v]]++];
+		inst.pos = toCvec3f(p.rbt.getTranslation());
+		inst.age = p.age;
+		inst.life = p.life;
+		inst.type = p.type;
+	}
 
-		//update color
-		if (particles[i].type == 0)
-		{
-			float prob = particles[i].life / particles[i].age;
-			if (prob < 1.75)
-			{//red
-				particles[i].color = Cvec3(1.0, 0.2, 0.0);
-			}
-			else if (prob < 3.0)
-			{//gold
-				particles[i].color = Cvec3(1.0, 0.8, 0.0);
-			}
-			else if (prob < 10.0)
-			{//yellow
-				particles[i].color = Cvec3(1.0, 1.0, 0.0);
-			}
-			else
-			{// initial light yellow
-				particles[i].color = Cvec3(1.0, 0.95, 0.8);
-			}
+	stream.vbo = *g_particleInstanceVbo;
+#ifndef __MAC__
+	if (g_particleInstanceRing)
+		stream.vbo = *g_particleInstanceRing;
+	else
+#endif
+	{
+		g_glState.bindBuffer(GL_ARRAY_BUFFER, *g_particleInstanceVbo);
+		glBufferData(GL_ARRAY_BUFFER, sizeof(ParticleInstance) * MaxParticles, NULL, GL_STREAM_DRAW);
+		glBufferSubData(GL_ARRAY_BUFFER, 0, sizeof(ParticleInstance) * numVisible, &g_particleInstances[0]);
+	}
+
+	// report the average savings every so often
+	g_drawnSinceReport += numVisible;
+	g_culledSinceReport += MaxParticles - numVisible;
+	for (int l = 0; l < g_numSphereLods; ++l)
+		g_lodDrawnSinceReport[l] += lodCount[l];
+	if (g_simStep % g_cullReportSteps == 0) {
+		if (g_cullParticles) {
+			cout << "Frustum culling: " << g_drawnSinceReport / g_cullReportSteps << " of " << MaxParticles
+				<< " particles drawn per frame, " << g_culledSinceReport / g_cullReportSteps << " culled" << endl;
 		}
+		if (g_particleLod && !g_particleImpostors && !g_particleSprites) {
+			cout << "Sphere LOD: particles per frame at each level, finest first:";
+			for (int l = 0; l < g_numSphereLods; ++l)
+				cout << " " << g_lodDrawnSinceReport[l] / g_cullReportSteps;
+			cout << endl;
+		}
+#ifndef __MAC__
+		if (g_particleInstanceRing && g_particleInstanceRing->stalls() > 0)
+			cout << "Instance stream: waited on the GPU " << g_particleInstanceRing->stalls() << " times so far" << endl;
+#endif
+		g_drawnSinceReport = g_culledSinceReport = 0;
+		for (int l = 0; l < g_numSphereLods; ++l)
+			g_lodDrawnSinceReport[l] = 0;
+	}
 
+	stream.stride = sizeof(ParticleInstance);
+	stream.posAge = (const char *)FIELD_OFFSET(ParticleInstance, pos) + base;
+	stream.life = (const char *)FIELD_OFFSET(ParticleInstance, life) + base;
+	stream.type = (const char *)FIELD_OFFSET(ParticleInstance, type) + base;
+}
 
-		//update "dead or alive" status of particles
-		if (particles[i].type == 0)
-		{
-			if (particles[i].age > particles[i].life || particles[i].rbt.getTranslation()[1] > 35 || particles[i].rbt.getTranslation()[1] < -25 || particles[i].rbt.getTranslation()[0] > 40 || particles[i].rbt.getTranslation()[0] < -40)
-			{
-				int prob = rand() % 100;
-				if (prob < 10)
-				{
-					Smoke_conversion(&particles[i]);
-				}
-				else
-				{
-					initParticleAttributes(&particles[i]);
-				}
+// The records of an instance stream starting at record first
+static InstanceStream offsetInstanceStream(const InstanceStream& stream, int first) {
+	InstanceStream r = stream;
+	const ptrdiff_t offset = (ptrdiff_t)stream.stride * first;
+	r.posAge = (const char *)stream.posAge + offset;
+	r.life = (const char *)stream.life + offset;
+	r.type = (const char *)stream.type + offset;
+	return r;
+}
+
+// --------- Closed-form particles
+//
+// Between two respawns a particle has constant velocity and a force growing by a
+// fixed amount per step, so after n steps from a base state
+//   pos = basePos + n * (velocity + force) + forceStep * n(n-1)/2 * Y
+//   age = baseAge + ageStep * n
+// and color/transparency are functions of age/life. PB_CLOSED_FORM uploads that base
+// state once per respawn and lets the vertex shader evaluate the rest; the CPU only
+// touches a particle at the step it is known to die.
+
+// Per-instance attributes consumed by particle-closedform-gl3.vshader
+struct ClosedFormRecord {
+	Cvec3f basePos;
+	Cvec3f baseVel;    // velocity plus the force at baseStep
+	float baseStep;
+	float baseAge;
+	float life;
+	float type;
+};
+
+static vector<ClosedFormRecord> g_closedFormRecords(MaxParticles);
+static int g_closedFormDirtyBegin = MaxParticles, g_closedFormDirtyEnd = 0; // records to upload
+// (death step, particle index), earliest death on top
+static priority_queue<pair<int, int>, vector<pair<int, int> >, greater<pair<int, int> > > g_closedFormDeaths;
+static shared_ptr<GlBufferObject> g_closedFormVbo;
+static shared_ptr<GlArrayObject> g_closedFormVao;
+
+// Move a particle forward n steps in closed form
+static void advanceParticle(Particle *p, int n)
+{
+	const double forceStep = (p->type == 0) ? g_fireForceStep : g_smokeForceStep;
+	Cvec3 t = p->rbt.getTranslation() + (p->velocity + p->gravitational_force) * n;
+	t[1] += forceStep * n * (n - 1) / 2;
+	p->rbt.setTranslation(t);
+	p->gravitational_force[1] += forceStep * n;
+	p->age += g_ageStep * n;
+}
+
+// Number of steps after which the reference simulation would kill this particle
+static int stepsUntilDeath(Particle p)
+{
+	int n = 0;
+	do {
+		integrateParticle(&p);
+		++n;
+	} while (!isParticleDead(&p));
+	return n;
+}
+
+// Capture particle i's current state as its base at g_simStep and schedule its death
+static void captureClosedFormRecord(int i)
+{
+	const Particle& p = particles[i];
+	ClosedFormRecord& r = g_closedFormRecords[i];
+	r.basePos = toCvec3f(p.rbt.getTranslation());
+	r.baseVel = toCvec3f(p.velocity + p.gravitational_force);
+	r.baseStep = g_simStep;
+	r.baseAge = p.age;
+	r.life = p.life;
+	r.type = p.type;
+
+	g_closedFormDeaths.push(make_pair(g_simStep + stepsUntilDeath(p), i));
+	g_closedFormDirtyBegin = min(g_closedFormDirtyBegin, i);
+	g_closedFormDirtyEnd = max(g_closedFormDirtyEnd, i + 1);
+}
+
+// Switch particles[] from current state to closed-form base state
+static void enterClosedForm()
+{
+	g_closedFormDeaths = priority_queue<pair<int, int>, vector<pair<int, int> >, greater<pair<int, int> > >();
+	for (int i = 0; i < MaxParticles; i++)
+		captureClosedFormRecord(i);
+}
+
+// Switch particles[] back from base state to current state for the CPU backend
+static void leaveClosedForm()
+{
+	for (int i = 0; i < MaxParticles; i++)
+		advanceParticle(&particles[i], g_simStep - (int)g_closedFormRecords[i].baseStep);
+}
+
+// One simulation step: only the particles dying at this step are touched
+static void updateClosedFormParticles()
+{
+	while (!g_closedFormDeaths.empty() && g_closedFormDeaths.top().first <= g_simStep) {
+		const int i = g_closedFormDeaths.top().second;
+		g_closedFormDeaths.pop();
+
+		// smoke conversion keeps the position and force the fire died with
+		advanceParticle(&particles[i], g_simStep - (int)g_closedFormRecords[i].baseStep);
+		respawnParticle(&particles[i]);
+		captureClosedFormRecord(i);
+	}
+
+	if (g_closedFormDirtyBegin < g_closedFormDirtyEnd) {
+		g_glState.bindBuffer(GL_ARRAY_BUFFER, *g_closedFormVbo);
+		glBufferSubData(GL_ARRAY_BUFFER, sizeof(ClosedFormRecord) * g_closedFormDirtyBegin,
+			sizeof(ClosedFormRecord) * (g_closedFormDirtyEnd - g_closedFormDirtyBegin),
+			&g_closedFormRecords[g_closedFormDirtyBegin]);
+		g_closedFormDirtyBegin = MaxParticles;
+		g_closedFormDirtyEnd = 0;
+	}
+}
+
+// Bake the sphere mesh and the per-instance records into one VAO
+static void initClosedFormParticles() {
+	const ClosedFormShaderState& ss = *g_closedFormShaderState;
+
+	g_closedFormVbo.reset(new GlBufferObject);
+	g_glState.bindBuffer(GL_ARRAY_BUFFER, *g_closedFormVbo);
+	glBufferData(GL_ARRAY_BUFFER, sizeof(ClosedFormRecord) * MaxParticles, NULL, GL_DYNAMIC_DRAW);
+
+	g_closedFormVao.reset(new GlArrayObject);
+	g_glState.bindVertexArray(*g_closedFormVao);
+
+	// the sphere is drawn from the mesh arenas at its base vertex
+	g_glState.bindBuffer(GL_ARRAY_BUFFER, *g_vertexArena);
+	safe_glEnableVertexAttribArray(ss.h_aPosition);
+	safe_glEnableVertexAttribArray(ss.h_aNormal);
+	safe_glVertexAttribPointer(ss.h_aPosition, 3, GL_HALF_FLOAT, GL_FALSE, sizeof(VertexPN), FIELD_OFFSET(VertexPN, p));
+	safe_glVertexAttribPointer(ss.h_aNormal, 4, GL_INT_2_10_10_10_REV, GL_TRUE, sizeof(VertexPN), FIELD_OFFSET(VertexPN, n));
+
+	g_glState.bindBuffer(GL_ARRAY_BUFFER, *g_closedFormVbo);
+	safe_glEnableVertexAttribArray(ss.h_aBasePos);
+	safe_glEnableVertexAttribArray(ss.h_aBaseVel);
+	safe_glEnableVertexAttribArray(ss.h_aBaseParams);
+	safe_glVertexAttribPointer(ss.h_aBasePos, 3, GL_FLOAT, GL_FALSE, sizeof(ClosedFormRecord), FIELD_OFFSET(ClosedFormRecord, basePos));
+	safe_glVertexAttribPointer(ss.h_aBaseVel, 3, GL_FLOAT, GL_FALSE, sizeof(ClosedFormRecord), FIELD_OFFSET(ClosedFormRecord, baseVel));
+	safe_glVertexAttribPointer(ss.h_aBaseParams, 4, GL_FLOAT, GL_FALSE, sizeof(ClosedFormRecord), FIELD_OFFSET(ClosedFormRecord, baseStep));
+	safe_glVertexAttribDivisor(ss.h_aBasePos, 1);
+	safe_glVertexAttribDivisor(ss.h_aBaseVel, 1);
+	safe_glVertexAttribDivisor(ss.h_aBaseParams, 1);
+
+	g_glState.bindBuffer(GL_ELEMENT_ARRAY_BUFFER, *g_indexArena);
+
+	g_glState.bindVertexArray(0);
+	checkGlErrors();
+}
+
+static void drawClosedFormParticles() {
+	const ClosedFormShaderState& ss = *g_closedFormShaderState;
+	g_glState.useProgram(ss.program);
+	safe_glUniform1f(ss.h_uStep, g_simStep);
+
+	g_glState.bindVertexArray(*g_closedFormVao);
+	glDrawElementsInstancedBaseVertex(GL_TRIANGLES, g_sphere->iboLen, GL_UNSIGNED_SHORT, g_sphere->indexOffset(),
+		MaxParticles, g_sphere->baseVertex);
+}
+
+// --------- Compute shader particles
+//
+// PB_COMPUTE keeps the whole particle state in a shader storage buffer. Each step
+// particle-update-gl4.cshader integrates, kills and respawns particles
+// (with a per-particle xorshift RNG), and the same buffer is then bound as the
+// per-instance vertex stream of particle-gl3.vshader, so nothing comes back to the
+// CPU. particles[] is only synchronized when switching backends.
+
+// One particle as laid out in the storage buffer (std430), must match
+// struct Particle in particle-update-gl4.cshader
+struct GpuParticle {
+	Cvec3f pos;
+	float age;
+	Cvec3f velocity;
+	float life;
+	Cvec3f force;
+	float type;
+	unsigned int seed;
+	unsigned int pad[3];  // std430 rounds the struct up to a multiple of 16 bytes
+};
+
+static GpuParticle toGpuParticle(const Particle& p, unsigned int seed) {
+	GpuParticle g;
+	g.pos = toCvec3f(p.rbt.getTranslation());
+	g.age = p.age;
+	g.velocity = toCvec3f(p.velocity);
+	g.life = p.life;
+	g.force = toCvec3f(p.gravitational_force);
+	g.type = p.type;
+	g.seed = seed;
+	g.pad[0] = g.pad[1] = g.pad[2] = 0;
+	return g;
+}
+
+static void fromGpuParticle(const GpuParticle& g, Particle *p) {
+	p->rbt.setTranslation(Cvec3(g.pos[0], g.pos[1], g.pos[2]));
+	p->age = g.age;
+	p->velocity = Cvec3(g.velocity[0], g.velocity[1], g.velocity[2]);
+	p->life = g.life;
+	p->type = (int)g.type;
+	p->gravitational_force = Cvec3(g.force[0], g.force[1], g.force[2]);
+}
+
+#ifndef __MAC__
+static shared_ptr<GlBufferObject> g_computeSsbo;
+
+static shared_ptr<GlBufferObject> g_culledInstanceBuffer; // ParticleInstance records written by the cull pass
+static shared_ptr<GlBufferObject> g_drawCommandBuffer;    // one DrawElementsIndirectCommand
+
+// Upload particles[] into the storage buffer, seeding each particle's RNG
+static void enterComputeParticles()
+{
+	vector<GpuParticle> gpu(MaxParticles);
+	for (int i = 0; i < MaxParticles; i++)
+		gpu[i] = toGpuParticle(particles[i], ((unsigned int)rand() << 16 ^ rand()) | 1); // xorshift needs a nonzero seed
+
+	g_glState.bindBuffer(GL_SHADER_STORAGE_BUFFER, *g_computeSsbo);
+	glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, sizeof(GpuParticle) * MaxParticles, &gpu[0]);
+}
+
+static void readComputeParticles(vector<GpuParticle>& gpu)
+{
+	gpu.resize(MaxParticles);
+	glMemoryBarrier(GL_BUFFER_UPDATE_BARRIER_BIT);
+	g_glState.bindBuffer(GL_SHADER_STORAGE_BUFFER, *g_computeSsbo);
+	glGetBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, sizeof(GpuParticle) * MaxParticles, &gpu[0]);
+}
+
+// Read the storage buffer back into particles[] for the other backends
+static void leaveComputeParticles()
+{
+	vector<GpuParticle> gpu;
+	readComputeParticles(gpu);
+	for (int i = 0; i < MaxParticles; i++)
+		fromGpuParticle(gpu[i], &particles[i]);
+}
+
+static void updateComputeParticles()
+{
+	const ParticleUpdateShaderState& ss = *g_particleUpdateShaderState;
+	g_glState.useProgram(ss.program);
+	safe_glUniform1i(ss.h_uCount, MaxParticles);
+	safe_glUniform1f(ss.h_uAgeStep, g_ageStep);
+	safe_glUniform2f(ss.h_uForceStep, g_fireForceStep, g_smokeForceStep);
+
+	g_glState.bindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, *g_computeSsbo);
+	glDispatchCompute((MaxParticles + g_particleUpdateGroupSize - 1) / g_particleUpdateGroupSize, 1, 1);
+
+	// the draw reads the buffer as instanced vertex attributes, and the next
+	// update or cull dispatch reads it as storage
+	glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT | GL_VERTEX_ATTRIB_ARRAY_BARRIER_BIT);
+}
+
+// Frustum cull the storage buffer on the GPU: visible particles are appended to
+// g_culledInstanceBuffer and counted in g_drawCommandBuffer, ready for mesh's drawIndirect
+static void cullComputeParticles(const Matrix4& projView, const Geometry& mesh)
+{
+	// reset the command; only instanceCount is written by the shader
+	const DrawElementsIndirectCommand command = mesh.indirectCommand(0, 0);
+	g_glState.bindBuffer(GL_SHADER_STORAGE_BUFFER, *g_drawCommandBuffer);
+	glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, sizeof(command), &command);
+
+	const ParticleCullShaderState& ss = *g_particleCullShaderState;
+	g_glState.useProgram(ss.program);
+	safe_glUniform1i(ss.h_uCount, MaxParticles);
+	safe_glUniform1f(ss.h_uRadius, g_particleRadius * g_particleScale);
+	const Frustum frustum = makeFrustum(projView);
+	if (ss.h_uFrustum >= 0)
+		glUniform4fv(ss.h_uFrustum, 6, &frustum.planes[0][0]);
+
+	g_glState.bindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, *g_computeSsbo);
+	g_glState.bindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, *g_culledInstanceBuffer);
+	g_glState.bindBufferBase(GL_SHADER_STORAGE_BUFFER, 2, *g_drawCommandBuffer);
+	glDispatchCompute((MaxParticles + g_particleUpdateGroupSize - 1) / g_particleUpdateGroupSize, 1, 1);
+
+	// the draw that follows reads the command and the culled instances
+	glMemoryBarrier(GL_COMMAND_BARRIER_BIT | GL_VERTEX_ATTRIB_ARRAY_BARRIER_BIT);
+}
+
+static void initComputeParticles() {
+	g_computeSsbo.reset(new GlBufferObject);
+	g_glState.bindBuffer(GL_SHADER_STORAGE_BUFFER, *g_computeSsbo);
+	glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(GpuParticle) * MaxParticles, NULL, GL_DYNAMIC_COPY);
+
+	g_culledInstanceBuffer.reset(new GlBufferObject);
+	g_glState.bindBuffer(GL_SHADER_STORAGE_BUFFER, *g_culledInstanceBuffer);
+	glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(ParticleInstance) * MaxParticles, NULL, GL_DYNAMIC_COPY);
+
+	g_drawCommandBuffer.reset(new GlBufferObject);
+	g_glState.bindBuffer(GL_SHADER_STORAGE_BUFFER, *g_drawCommandBuffer);
+	glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(DrawElementsIndirectCommand), NULL, GL_DYNAMIC_DRAW);
+	checkGlErrors();
+}
+
+// The compacted output of cullComputeParticles as the per-instance vertex stream
+static InstanceStream culledInstanceStream() {
+	InstanceStream stream;
+	stream.vbo = *g_culledInstanceBuffer;
+	stream.stride = sizeof(ParticleInstance);
+	stream.posAge = FIELD_OFFSET(ParticleInstance, pos);
+	stream.life = FIELD_OFFSET(ParticleInstance, life);
+	stream.type = FIELD_OFFSET(ParticleInstance, type);
+	return stream;
+}
+
+// The storage buffer read directly as the per-instance vertex stream
+static InstanceStream computeInstanceStream() {
+	InstanceStream stream;
+	stream.vbo = *g_computeSsbo;
+	stream.stride = sizeof(GpuParticle);
+	stream.posAge = FIELD_OFFSET(GpuParticle, pos);
+	stream.life = FIELD_OFFSET(GpuParticle, life);
+	stream.type = FIELD_OFFSET(GpuParticle, type);
+	return stream;
+}
+
+static bool nearlyEqual(const Cvec3f& a, const Cvec3& b) {
+	for (int i = 0; i < 3; ++i) {
+		if (fabs(a[i] - b[i]) > 1e-4 * (1 + fabs(b[i])))
+			return false;
+	}
+	return true;
+}
+
+// Run the compute backend for a number of steps and check every particle of every
+// step against the CPU reference: survivors must match one step of updateParticles(),
+// and dead particles must have been respawned as fresh fire or converted to smoke in
+// place. Returns true when no particle disagrees. Reads the buffer back after every
+// step, so this is meant for CI (e.g. Mesa llvmpipe), not for interactive use.
+static bool validateComputeParticles(int steps) {
+	enterComputeParticles();
+
+	vector<GpuParticle> before, after;
+	readComputeParticles(before);
+	int checked = 0, respawned = 0, failures = 0;
+	for (int s = 0; s < steps; ++s) {
+		updateComputeParticles();
+		readComputeParticles(after);
+
+		for (int i = 0; i < MaxParticles; i++) {
+			Particle ref;
+			fromGpuParticle(before[i], &ref);
+			integrateParticle(&ref);
+
+			const GpuParticle& g = after[i];
+			bool ok;
+			if (!isParticleDead(&ref)) {
+				ok = g.type == ref.type && fabs(g.age - ref.age) < 1e-4 && g.life == ref.life &&
+					nearlyEqual(g.pos, ref.rbt.getTranslation()) &&
+					nearlyEqual(g.velocity, ref.velocity) &&
+					nearlyEqual(g.force, ref.gravitational_force);
 			}
-		}
-		else
-		{
-			if (particles[i].age > particles[i].life || particles[i].rbt.getTranslation()[1] > 45 || particles[i].rbt.getTranslation()[1] < -35 || particles[i].rbt.getTranslation()[0] > 80 || particles[i].rbt.getTranslation()[0] < -80)
-			{
-				particles[i].type = 0;
-				initParticleAttributes(&particles[i]);
+			else {
+				++respawned;
+				if (g.type == 1) // fire converted to smoke where it died
+					ok = ref.type == 0 && g.life > 5 && g.life <= 17.5 &&
+						nearlyEqual(g.pos, ref.rbt.getTranslation()) && nearlyEqual(g.force, ref.gravitational_force);
+				else             // reborn as fire at the source
+					ok = g.pos[1] == -5.0 && g.life > 0 && g.life <= 1.0 && norm2(g.force) == 0;
+				ok = ok && g.age == 0;
 			}
+			++checked;
+			if (!ok && ++failures <= 10)
+				cerr << "compute validation: particle " << i << " diverged at step " << s + 1 << endl;
 		}
+		before.swap(after);
+	}
 
+	cout << "compute validation: " << steps << " steps, " << checked << " particle updates, "
+		<< respawned << " respawns, " << failures << " failures" << endl;
+
+	// the GPU cull of the final state must keep as many particles as cullSpheres
+	const Matrix4 projView = makeProjectionMatrix() * rigTFormToMatrix(inv(g_skyRbt));
+	cullComputeParticles(projView, *g_sphere);
+	DrawElementsIndirectCommand command;
+	glMemoryBarrier(GL_BUFFER_UPDATE_BARRIER_BIT);
+	g_glState.bindBuffer(GL_SHADER_STORAGE_BUFFER, *g_drawCommandBuffer);
+	glGetBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, sizeof(command), &command);
+
+	vector<float> x(MaxParticles), y(MaxParticles), z(MaxParticles);
+	for (int i = 0; i < MaxParticles; i++) {
+		x[i] = before[i].pos[0];
+		y[i] = before[i].pos[1];
+		z[i] = before[i].pos[2];
 	}
+	vector<int> visible(MaxParticles);
+	const int expected = cullSpheres(makeFrustum(projView), &x[0], &y[0], &z[0], MaxParticles,
+		g_particleRadius * g_particleScale, &visible[0]);
+
+	// a sphere grazing a plane may round differently on the GPU
+	const bool cullOk = abs((int)command.instanceCount - expected) <= 1;
+	cout << "compute validation: GPU cull kept " << command.instanceCount << " particles, CPU cull "
+		<< expected << (cullOk ? "" : " (MISMATCH)") << endl;
+	return failures == 0 && cullOk;
+}
+#endif
 
+static bool isParticleBackendAvailable(int backend) {
+	switch (backend) {
+	case PB_CLOSED_FORM:
+		return g_closedFormShaderState;
+#ifndef __MAC__
+	case PB_COMPUTE:
+		return g_particleUpdateShaderState;
+#endif
+	case PB_CPU:
+		return true;
+	}
+	return false;
 }
 
+// Cycle the particle backend, handing particles[] over from one backend's
+// representation to the next
+static void cycleParticleBackend() {
+	int next = (g_particleBackend + 1) % PB_NUM_BACKENDS;
+	while (!isParticleBackendAvailable(next))
+		next = (next + 1) % PB_NUM_BACKENDS;
+	if (next == g_particleBackend)
+		return;
+
+	if (g_particleBackend == PB_CLOSED_FORM)
+		leaveClosedForm();
+#ifndef __MAC__
+	if (g_particleBackend == PB_COMPUTE)
+		leaveComputeParticles();
+	if (next == PB_COMPUTE)
+		enterComputeParticles();
+#endif
+	if (next == PB_CLOSED_FORM)
+		enterClosedForm();
+	g_particleBackend = next;
+
+	static const char * const names[PB_NUM_BACKENDS] = { "cpu", "closed-form", "compute" };
+	cout << "Particle backend: " << names[g_particleBackend] << endl;
+}
 
+// One batch per level of detail, with the program variant for its mesh. With
+// multi-draw indirect every sphere level goes out in a single call, each
+// picking its instances by base instance
+static void drawSphereLods(const InstanceStream& instances,
+	const int lodFirst[g_numSphereLods], const int lodCount[g_numSphereLods])
+{
+	bool multiDrawn = false;
+#ifndef __MAC__
+	if (g_lodCommandBuffer) {
+		DrawElementsIndirectCommand commands[g_numSphereLods];
+		int numCommands = 0;
+		for (int l = 0; l < g_numSphereLods; ++l) {
+			if (lodCount[l] > 0 && g_sphereLods[l].mesh != SM_BILLBOARD)
+				commands[numCommands++] = g_sphereLodGeometry[l]->indirectCommand(lodCount[l], lodFirst[l]);
+		}
+		if (numCommands > 0) {
+			g_glState.bindBuffer(GL_DRAW_INDIRECT_BUFFER, *g_lodCommandBuffer);
+			glBufferData(GL_DRAW_INDIRECT_BUFFER, sizeof(commands), NULL, GL_STREAM_DRAW);
+			glBufferSubData(GL_DRAW_INDIRECT_BUFFER, 0, sizeof(DrawElementsIndirectCommand) * numCommands, commands);
+			bindMeshVaoInstanced(instances);
+			g_glState.useProgram(particleShaderState(false).program);
+			glMultiDrawElementsIndirect(GL_TRIANGLES, GL_UNSIGNED_SHORT, 0, numCommands, 0);
+		}
+		multiDrawn = true;
+	}
+#endif
 
+	for (int l = 0; l < g_numSphereLods; ++l) {
+		const bool billboard = g_sphereLods[l].mesh == SM_BILLBOARD;
+		if (lodCount[l] == 0 || (multiDrawn && !billboard))
+			continue;
+		g_glState.useProgram(particleShaderState(billboard).program);
+		g_sphereLodGeometry[l]->drawInstanced(offsetInstanceStream(instances, lodFirst[l]), lodCount[l]);
+	}
+}
 
 static void drawStuff() {
 	//get eye coordinates of the center of the sphere
@@ -397,46 +1455,656 @@ static void drawStuff() {
 	}
 
 	// short hand for current shader state
-	const ShaderState& curSS = *g_shaderStates[g_activeShader];
+	const bool quads = g_particleImpostors || g_particleSprites;  // one quad per particle
+	const ShaderState& curSS = g_particleSprites ? *g_spriteShaderState
+		: (g_particleImpostors ? *g_impostorShaderState : particleShaderState(false));
 
-	// build & send proj. matrix to vshader
 	const Matrix4 projmat = makeProjectionMatrix();
-	sendProjectionMatrix(curSS, projmat);
 
 	eyeRbt = g_skyRbt;
 	const RigTForm invEyeRbt = inv(eyeRbt);
 
-	const Cvec3 eyeLight1 = Cvec3(invEyeRbt * Cvec4(g_light1, 1)); // g_light1 position in eye coordinates
-	const Cvec3 eyeLight2 = Cvec3(invEyeRbt * Cvec4(g_light2, 1)); // g_light2 position in eye coordinates
-	safe_glUniform3f(curSS.h_uLight, eyeLight1[0], eyeLight1[1], eyeLight1[2]);
-	safe_glUniform3f(curSS.h_uLight2, eyeLight2[0], eyeLight2[1], eyeLight2[2]);
-
 	glPolygonMode(GL_FRONT_AND_BACK, GL_FILL);
 
-    updateParticles();
-	for (int i = 0; i < MaxParticles; i++) {
-		Matrix4 MVM = rigTFormToMatrix(invEyeRbt * particles[i].rbt) * Matrix4::makeScale(Cvec3(0.02, 0.02, 0.02));
-		sendModelViewNormalMatrix(curSS, MVM, normalMatrix(MVM));
-		safe_glUniform3f(curSS.h_uColor, particles[i].color[0], particles[i].color[1], particles[i].color[2]); // set color to grayish
-		safe_glUniform1f(curSS.h_uTransparency, 1 - particles[i].age / particles[i].life);
-		particles[i].sphere->draw(curSS);
+	// color and opacity over life for every particle path
+	glActiveTexture(GL_TEXTURE0);
+	glBindTexture(GL_TEXTURE_1D_ARRAY, *g_rampTexture);
+	if (g_particleSprites) {
+		// and the frames of the whole particle set
+		glActiveTexture(GL_TEXTURE1);
+		glBindTexture(GL_TEXTURE_2D, *g_spriteTexture);
+		glActiveTexture(GL_TEXTURE0);
 	}
-	glutPostRedisplay();
+
+	sendPerFrameBlock(projmat, invEyeRbt);
+
+	// particles are alpha blended whichever backend draws them
+	g_glState.setBlend(true);
+	g_glState.blendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+
+	if (g_simulate)
+		++g_simStep;
+	if (g_particleBackend == PB_CLOSED_FORM) {
+		if (g_simulate) {
+			beginFramePhase(FP_UPDATE);
+			updateClosedFormParticles();
+			endFramePhase();
+		}
+		beginFramePhase(FP_DRAW);
+		drawClosedFormParticles();
+		endFramePhase();
+		return;
+	}
+
+	InstanceStream instances;
+	int lodFirst[g_numSphereLods], lodCount[g_numSphereLods];  // instance ranges per level of detail
+	for (int l = 0; l < g_numSphereLods; ++l)
+		lodFirst[l] = lodCount[l] = 0;
+	lodCount[g_defaultSphereLod] = MaxParticles;
+	bool indirect = false;    // instance count lives in g_drawCommandBuffer
+	// the mesh of an indirect draw, whose own index count goes into the command
+	Geometry& indirectMesh = quads ? *g_particleQuad : *g_sphere;
+#ifndef __MAC__
+	if (g_particleBackend == PB_COMPUTE) {
+		if (g_simulate) {
+			beginFramePhase(FP_UPDATE);
+			updateComputeParticles();
+			endFramePhase();
+		}
+		if (g_cullParticles) {
+			beginFramePhase(FP_CULL);
+			cullComputeParticles(projmat * rigTFormToMatrix(invEyeRbt), indirectMesh);
+			endFramePhase();
+			instances = culledInstanceStream();
+			indirect = true;
+		}
+		else
+			instances = computeInstanceStream();
+	}
+	else
+#endif
+	{
+		if (g_simulate) {
+			beginFramePhase(FP_UPDATE);
+			updateParticles();
+			endFramePhase();
+		}
+		beginFramePhase(FP_UPLOAD);
+		uploadParticleInstances(projmat, projmat * rigTFormToMatrix(invEyeRbt), instances, lodFirst, lodCount);
+		endFramePhase();
+	}
+
+	// matrices, lights and scale are already in the uniform blocks
+	beginFramePhase(FP_DRAW);
+	g_glState.useProgram(curSS.program);
+
+#ifndef __MAC__
+	if (indirect)
+		indirectMesh.drawIndirect(instances, *g_drawCommandBuffer);
+	else
+#endif
+	if (quads) {
+		// the billboard quad, whatever the level of detail
+		int numInstances = 0;
+		for (int l = 0; l < g_numSphereLods; ++l)
+			numInstances += lodCount[l];
+		g_particleQuad->drawInstanced(instances, numInstances);
+	}
+	else
+		drawSphereLods(instances, lodFirst, lodCount);
+	endFramePhase();
+#ifndef __MAC__
+	// the instances written this frame are free again once these draws finish
+	if (g_particleBackend == PB_CPU && g_particleInstanceRing)
+		g_particleInstanceRing->endRegion();
+#endif
 }
 
 
-static void display() {
-	glUseProgram(g_shaderStates[g_activeShader]->program);
+// Frames are read back asynchronously, for screenshots ('s') and for continuous
+// capture ('r', or --capture): a frame is read into the next of a ring of pixel
+// pack buffers, which is mapped a frame or two later, once the GPU is done with
+// it, and the pixels are encoded and written by the I/O thread. Memory in flight
+// is bounded by the ring and the I/O queue. A captured frame that finds the queue
+// full is dropped and counted, so a slow disk or encoder never stalls rendering,
+// unless --capture-wait asks for every frame at the cost of waiting instead
+struct FrameReadback {
+	shared_ptr<GlBufferObject> pbo;
+	GLsync fence;             // 0 without sync objects
+	int width, height;
+	int frame;                // when the read was issued, or -1 when idle
+	string screenshotFile;    // the PPM the frame goes to, if any
+	shared_ptr<FrameStreamWriter> capture;  // the stream the frame goes to, if any
+};
+
+static const int g_numFrameReadbacks = 3;  // a readback is mapped at the latest two frames later
+static const int g_ioQueueLength = 4;      // frames waiting for the I/O thread
+static FrameReadback g_frameReadbacks[g_numFrameReadbacks];
+static int g_nextFrameReadback = 0;
+static int g_displayedFrames = 0;
+static string g_screenshotFile;  // for the next frame, if not empty
+static string g_imageFormat = "ppm";  // of screenshots and batch frames: "ppm" or "qoi"
+static shared_ptr<WorkerThread> g_ioThread;  // started by the first readback
+
+static bool g_capturing = false;
+static string g_captureFilename = "capture.y4m";  // "-" is stdout
+static string g_captureFormat;                    // "raw" or "y4m"; empty to go by the file name
+static bool g_captureWait = false;
+static const int g_captureFps = 60;
+static shared_ptr<FrameStreamWriter> g_capture;  // opened at the first captured frame
+static int g_capturedFrames = 0, g_droppedFrames = 0;
+
+// Writes a PPM, or a QOI for a .qoi file
+class ImageWriteJob : public WorkerJob {
+	string filename_;
+	int width_, height_;
+	vector<unsigned char> pixels_;
+
+public:
+	ImageWriteJob(const char *filename, int width, int height, const unsigned char *pixels)
+		: filename_(filename), width_(width), height_(height), pixels_(pixels, pixels + 3 * width * height)
+	{}
+
+	virtual void run() {
+		if (filename_.size() >= 4 && filename_.compare(filename_.size() - 4, 4, ".qoi") == 0)
+			writeQoi(filename_.c_str(), width_, height_, &pixels_[0]);
+		else
+			writePpm(filename_.c_str(), width_, height_, &pixels_[0]);
+	}
+};
+
+// Holds on to its stream, which is closed once the last frame is written
+class CaptureFrameJob : public WorkerJob {
+	shared_ptr<FrameStreamWriter> stream_;
+	vector<unsigned char> pixels_;
+
+public:
+	CaptureFrameJob(const shared_ptr<FrameStreamWriter>& stream, const unsigned char *pixels)
+		: stream_(stream), pixels_(pixels, pixels + 3 * stream->width() * stream->height())
+	{}
+
+	virtual void run() {
+		stream_->writeFrame(&pixels_[0]);
+	}
+};
+
+static bool readbackFencesSupported() {
+#ifdef __MAC__
+	return true;
+#else
+	return GLEW_VERSION_3_2 || GLEW_ARB_sync;
+#endif
+}
+
+static void reportCapture() {
+	cout << "Capture: " << g_capturedFrames << " frames written, " << g_droppedFrames << " dropped";
+	if (g_ioThread)
+		cout << ", " << g_ioThread->pending() << " queued";
+	cout << endl;
+}
+
+static void toggleCapture() {
+	g_capturing = !g_capturing;
+	if (g_capturing) {
+		g_capturedFrames = g_droppedFrames = 0;
+		cout << "Capturing to " << g_captureFilename << endl;
+	}
+	else {
+		reportCapture();
+		g_capture.reset();  // frames still in flight keep the stream open
+	}
+}
+
+static void queueCaptureFrame(const FrameReadback& r, const unsigned char *pixels) {
+	if (r.width != r.capture->width() || r.height != r.capture->height()) {
+		++g_droppedFrames;  // the stream has the size of its first frame
+		return;
+	}
+
+	CaptureFrameJob *job = new CaptureFrameJob(r.capture, pixels);
+	if (g_captureWait)
+		g_ioThread->post(job);
+	else if (!g_ioThread->tryPost(job)) {
+		delete job;
+		++g_droppedFrames;
+		return;
+	}
+	++g_capturedFrames;
+}
+
+// Maps the readbacks of earlier frames that are done, or all of them if asked
+// to wait, and queues their pixels for writing
+static void collectFrameReadbacks(bool wait) {
+	for (int i = 0; i < g_numFrameReadbacks; ++i) {
+		FrameReadback& r = g_frameReadbacks[i];
+		if (!r.pbo || r.frame < 0 || (r.frame == g_displayedFrames && !wait))
+			continue;
+
+		// wait for the fence until the slot is about to be reused; without one,
+		// a frame is assumed to be enough
+		const bool due = wait || g_displayedFrames - r.frame >= g_numFrameReadbacks - 1;
+		if (r.fence) {
+			if (!due && glClientWaitSync(r.fence, 0, 0) == GL_TIMEOUT_EXPIRED)
+				continue;
+			glDeleteSync(r.fence);
+			r.fence = 0;
+		}
+
+		g_glState.bindBuffer(GL_PIXEL_PACK_BUFFER, *r.pbo);
+		const unsigned char *pixels = (const unsigned char *)glMapBuffer(GL_PIXEL_PACK_BUFFER, GL_READ_ONLY);
+		if (pixels) {
+			if (!g_ioThread)
+				g_ioThread.reset(new WorkerThread(g_ioQueueLength));
+			if (!r.screenshotFile.empty())
+				g_ioThread->post(new ImageWriteJob(r.screenshotFile.c_str(), r.width, r.height, pixels));
+			if (r.capture)
+				queueCaptureFrame(r, pixels);
+			glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+		}
+		r.frame = -1;
+		r.capture.reset();
+	}
+	g_glState.bindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+}
+
+// Called after drawing each frame, before the swap. This frame's read is issued
+// before older ones are mapped, so a map never waits on this frame's rendering
+static void updateFrameReadbacks() {
+	if (g_capturing && !g_capture) {
+		try {
+			const FrameStreamWriter::Format format = g_captureFormat.empty()
+				? FrameStreamWriter::formatForFilename(g_captureFilename.c_str())
+				: (g_captureFormat == "raw" ? FrameStreamWriter::RAW_RGB : FrameStreamWriter::Y4M);
+			g_capture.reset(new FrameStreamWriter(g_captureFilename.c_str(), format, g_windowWidth, g_windowHeight, g_captureFps));
+		}
+		catch (const runtime_error& e) {
+			cout << e.what() << endl;
+			g_capturing = false;
+		}
+	}
+
+	if (!g_screenshotFile.empty() || g_capture) {
+		// this slot was mapped by last frame at the latest
+		FrameReadback& r = g_frameReadbacks[g_nextFrameReadback];
+		g_nextFrameReadback = (g_nextFrameReadback + 1) % g_numFrameReadbacks;
+		if (!r.pbo)
+			r.pbo.reset(new GlBufferObject);
+		r.width = g_windowWidth;
+		r.height = g_windowHeight;
+		r.frame = g_displayedFrames;
+		r.screenshotFile = g_screenshotFile;
+		r.capture = g_capture;
+		g_glState.bindBuffer(GL_PIXEL_PACK_BUFFER, *r.pbo);
+		glBufferData(GL_PIXEL_PACK_BUFFER, 3 * r.width * r.height, NULL, GL_STREAM_READ);
+		glReadPixels(0, 0, r.width, r.height, GL_RGB, GL_UNSIGNED_BYTE, 0);
+		r.fence = readbackFencesSupported() ? glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0) : 0;
+		g_screenshotFile.clear();
+	}
+
+	collectFrameReadbacks(false);
+	++g_displayedFrames;
+}
+
+// Posters ('P', or --poster): a frame of any size, drawn as a grid of tiles
+// into a framebuffer object of at most g_posterTileSize square, each tile
+// through its own off-center part of the poster's view frustum. A row of tiles
+// is read back into one band of pixels and streamed to the PPM before the next
+// is drawn, so memory grows with the poster's width only. The simulation is not
+// stepped between tiles, and levels of detail go by the poster's pixels
+static const int g_posterTileSize = 1024;
+static string g_posterFile;                        // for the next frame, if not empty
+static int g_posterWidth = 0, g_posterHeight = 0;  // 0 for four times the window size
+
+static void drawPosterTiles(PpmStreamWriter& out, const int width, const int height, const int tileSize) {
+	vector<unsigned char> band((size_t)3 * width * min(height, tileSize));
+	g_glState.bindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+	glPixelStorei(GL_PACK_ROW_LENGTH, width);   // tiles go side by side into the band
+
+	PosterTile tile;
+	tile.width = width;
+	tile.height = height;
+	g_posterTile = &tile;
+	for (tile.y0 = 0; tile.y0 < height; tile.y0 = tile.y1) {
+		tile.y1 = min(height, tile.y0 + tileSize);
+		for (tile.x0 = 0; tile.x0 < width; tile.x0 = tile.x1) {
+			tile.x1 = min(width, tile.x0 + tileSize);
+			g_windowWidth = tile.x1 - tile.x0;
+			g_windowHeight = tile.y1 - tile.y0;
+			glViewport(0, 0, g_windowWidth, g_windowHeight);
+
+			glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+			drawStuff();
+			glReadPixels(0, 0, g_windowWidth, g_windowHeight, GL_RGB, GL_UNSIGNED_BYTE, &band[3 * tile.x0]);
+		}
+		out.writeRows(&band[0], tile.y1 - tile.y0);
+	}
+}
+
+// Draws the current simulation step again as a width x height poster
+static void renderPoster(const string& filename, const int width, const int height) {
+	const int tileSize = min(g_posterTileSize, max(width, height));
+	PpmStreamWriter out(filename.c_str(), width, height);
+
+	GlRenderbuffer color, depth;
+	glBindRenderbuffer(GL_RENDERBUFFER, color);
+	glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, tileSize, tileSize);
+	glBindRenderbuffer(GL_RENDERBUFFER, depth);
+	glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, tileSize, tileSize);
+
+	GLint prevFramebuffer, prevDrawBuffer, prevReadBuffer;
+	glGetIntegerv(GL_DRAW_FRAMEBUFFER_BINDING, &prevFramebuffer);
+	glGetIntegerv(GL_DRAW_BUFFER, &prevDrawBuffer);
+	glGetIntegerv(GL_READ_BUFFER, &prevReadBuffer);
+	const int prevWidth = g_windowWidth, prevHeight = g_windowHeight;
+
+	GlFramebuffer fbo;
+	glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+	glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, color);
+	glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, depth);
+	if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+		throw runtime_error("Framebuffer for poster rendering is incomplete");
+	glDrawBuffer(GL_COLOR_ATTACHMENT0);
+	glReadBuffer(GL_COLOR_ATTACHMENT0);
+
+	const int tilesAcross = (width + tileSize - 1) / tileSize, tilesDown = (height + tileSize - 1) / tileSize;
+	cout << "Rendering a " << width << "x" << height << " poster as " << tilesAcross << "x" << tilesDown
+		<< " tiles into " << filename << endl;
+	g_simulate = false;
+	string error;  // thrown again once the window's state is back
+	try {
+		drawPosterTiles(out, width, height, tileSize);
+		out.close();
+	}
+	catch (const runtime_error& e) {
+		error = e.what();
+	}
+	g_posterTile = NULL;
+	g_simulate = true;
+
+	glPixelStorei(GL_PACK_ROW_LENGTH, 0);
+	glBindFramebuffer(GL_FRAMEBUFFER, prevFramebuffer);
+	glDrawBuffer(prevDrawBuffer);
+	glReadBuffer(prevReadBuffer);
+	g_windowWidth = prevWidth;
+	g_windowHeight = prevHeight;
+	glViewport(0, 0, g_windowWidth, g_windowHeight);
+	if (!error.empty())
+		throw runtime_error(error);
+}
+
+// Frame timing: the times of each frame come back from g_frameTimer a few
+// frames late, and go to the timing graph ('t', or --hud), to a CSV file with a
+// row per frame (--frame-times), and to the periodic report. The graph has a
+// column per recent frame: the GPU time of each phase stacked on its left, the
+// CPU time on its right (gray for the CPU time outside the phases), over a bar
+// that is orange where the GPU bound the frame and blue where the CPU did, with
+// lines at 60 and 30 frames per second
+static bool g_showHud = false;
+static const int g_hudFrames = 120;         // columns
+static const int g_hudColumnWidth = 4;      // pixels: 2 GPU, 1 CPU, 1 gap
+static const int g_hudMargin = 8;           // pixels from the bottom left corner
+static const int g_hudHeight = 120;         // pixels for g_hudRangeMs
+static const double g_hudRangeMs = 40.0;
+static const GLubyte g_framePhaseColors[FP_NUM_PHASES][4] = {
+	{ 128, 128, 255, 255 },   // clear
+	{ 255, 200, 0, 255 },     // update
+	{ 255, 0, 255, 255 },     // cull
+	{ 0, 200, 255, 255 },     // upload
+	{ 0, 255, 0, 255 },       // draw
+	{ 255, 255, 255, 255 },   // hud
+	{ 255, 64, 64, 255 }      // readback
+};
+static deque<FrameTimes> g_hudFrameTimes;   // oldest first
+
+static FILE *g_frameTimesCsv = NULL;
+
+// sums over the frames since the last report; the GPU ones only over the
+// frames with GPU times
+static int g_timedFrames = 0, g_gpuTimedFrames = 0, g_gpuBoundFrames = 0;
+static double g_cpuFrameMs = 0, g_gpuBusyMs = 0;
+static double g_cpuPhaseMs[FP_NUM_PHASES], g_gpuPhaseMs[FP_NUM_PHASES];
+
+struct HudVertex {
+	GLfloat x, y;             // pixels
+	GLubyte color[4];
+};
+
+struct HudShaderState {
+	GlProgram program;
+
+	GLint h_uViewport;
+
+	HudShaderState(ProgramCache& cache, const char* vsfn, const char* fsfn) {
+		static const char * const names[2] = { "aPosition", "aColor" };
+		cache.addProgram(program, vsfn, fsfn, 2, names);
+	}
+
+	// once the cache has finished the program
+	void init() {
+		h_uViewport = safe_glGetUniformLocation(program, "uViewport");
+		checkGlErrors();
+	}
+};
+
+static const char * const g_hudShaderFiles[2] = { "./shaders/hud-gl3.vshader", "./shaders/hud-gl3.fshader" };
+static shared_ptr<HudShaderState> g_hudShaderState;
+static shared_ptr<GlBufferObject> g_hudVbo;
+static shared_ptr<GlArrayObject> g_hudVao;
+
+static void initHud() {
+	g_hudVbo.reset(new GlBufferObject);
+	g_hudVao.reset(new GlArrayObject);
+	g_glState.bindVertexArray(*g_hudVao);
+	g_glState.bindBuffer(GL_ARRAY_BUFFER, *g_hudVbo);
+	glEnableVertexAttribArray(0);
+	glEnableVertexAttribArray(1);
+	glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, sizeof(HudVertex), FIELD_OFFSET(HudVertex, x));
+	glVertexAttribPointer(1, 4, GL_UNSIGNED_BYTE, GL_TRUE, sizeof(HudVertex), FIELD_OFFSET(HudVertex, color));
+	g_glState.bindVertexArray(0);
+	checkGlErrors();
+}
+
+// Two triangles, with y1 clipped to the top of the graph
+static void addHudRect(vector<HudVertex>& vertices, float x0, float y0, float x1, float y1, const GLubyte color[4]) {
+	y1 = min(y1, float(g_hudMargin + 4 + g_hudHeight));
+	if (y1 <= y0)
+		return;
+	const float corners[6][2] = { { x0, y0 }, { x1, y0 }, { x1, y1 }, { x0, y0 }, { x1, y1 }, { x0, y1 } };
+	for (int i = 0; i < 6; ++i) {
+		HudVertex v;
+		v.x = corners[i][0];
+		v.y = corners[i][1];
+		memcpy(v.color, color, 4);
+		vertices.push_back(v);
+	}
+}
+
+static void drawHud() {
+	static const GLubyte background[4] = { 0, 0, 0, 160 };
+	static const GLubyte gridLine[4] = { 255, 255, 255, 96 };
+	static const GLubyte gpuBound[4] = { 255, 128, 0, 255 };
+	static const GLubyte cpuBound[4] = { 0, 128, 255, 255 };
+	static const GLubyte untimed[4] = { 128, 128, 128, 255 };
+	static const GLubyte cpuOther[4] = { 160, 160, 160, 255 };
+	const float left = g_hudMargin, bottom = g_hudMargin, base = bottom + 4;  // the bar under the columns
+	const float right = left + g_hudFrames * g_hudColumnWidth;
+	const float scale = g_hudHeight / g_hudRangeMs;  // pixels per millisecond
+
+	vector<HudVertex> vertices;
+	addHudRect(vertices, left, bottom, right, base + g_hudHeight, background);
+	for (size_t i = 0; i < g_hudFrameTimes.size(); ++i) {
+		const FrameTimes& t = g_hudFrameTimes[i];
+		const float x = left + i * g_hudColumnWidth;
+		addHudRect(vertices, x, bottom, x + g_hudColumnWidth, base - 1,
+			t.gpuFrame < 0 ? untimed : (t.gpuBound() ? gpuBound : cpuBound));
+
+		float gpuY = base, cpuY = base;
+		double cpuPhases = 0;
+		for (int p = 0; p < FP_NUM_PHASES; ++p) {
+			if (t.gpu[p] > 0) {
+				addHudRect(vertices, x, gpuY, x + 2, gpuY + t.gpu[p] * scale, g_framePhaseColors[p]);
+				gpuY += t.gpu[p] * scale;
+			}
+			addHudRect(vertices, x + 2, cpuY, x + 3, cpuY + t.cpu[p] * scale, g_framePhaseColors[p]);
+			cpuY += t.cpu[p] * scale;
+			cpuPhases += t.cpu[p];
+		}
+		addHudRect(vertices, x + 2, cpuY, x + 3, cpuY + (t.cpuFrame - cpuPhases) * scale, cpuOther);
+	}
+	for (int hz = 60; hz >= 30; hz /= 2) {
+		const float y = base + 1000.0 / hz * scale;
+		addHudRect(vertices, left, y, right, y + 1, gridLine);
+	}
+
+	g_glState.bindBuffer(GL_ARRAY_BUFFER, *g_hudVbo);
+	glBufferData(GL_ARRAY_BUFFER, sizeof(HudVertex) * vertices.size(), &vertices[0], GL_STREAM_DRAW);
+	g_glState.useProgram(g_hudShaderState->program);
+	safe_glUniform2f(g_hudShaderState->h_uViewport, g_windowWidth, g_windowHeight);
+	g_glState.bindVertexArray(*g_hudVao);
+	glDrawArrays(GL_TRIANGLES, 0, (GLsizei)vertices.size());
+}
+
+static void openFrameTimesCsv(const string& filename) {
+	g_frameTimesCsv = fopen(filename.c_str(), "w");
+	if (!g_frameTimesCsv)
+		throw runtime_error("Cannot write " + filename);
+	fprintf(g_frameTimesCsv, "frame,cpu_ms,gpu_ms,gpu_busy_ms,bound");
+	for (int p = 0; p < FP_NUM_PHASES; ++p)
+		fprintf(g_frameTimesCsv, ",cpu_%s_ms", g_framePhaseNames[p]);
+	for (int p = 0; p < FP_NUM_PHASES; ++p)
+		fprintf(g_frameTimesCsv, ",gpu_%s_ms", g_framePhaseNames[p]);
+	fprintf(g_frameTimesCsv, "\n");
+}
+
+// Takes the frames whose times are in. With wait, waits for every frame timed
+static void collectFrameTimes(bool wait) {
+	if (!g_frameTimer)
+		return;
+	if (wait)
+		g_frameTimer->finish();
+
+	FrameTimes t;
+	while (g_frameTimer->poll(t)) {
+		g_hudFrameTimes.push_back(t);
+		if ((int)g_hudFrameTimes.size() > g_hudFrames)
+			g_hudFrameTimes.pop_front();
+
+		const char *bound = t.gpuFrame < 0 ? "" : (t.gpuBound() ? "gpu" : "cpu");
+		if (g_frameTimesCsv) {
+			fprintf(g_frameTimesCsv, "%d,%.4f,%.4f,%.4f,%s", t.frame, t.cpuFrame, t.gpuFrame, t.gpuBusy(), bound);
+			for (int p = 0; p < FP_NUM_PHASES; ++p)
+				fprintf(g_frameTimesCsv, ",%.4f", t.cpu[p]);
+			for (int p = 0; p < FP_NUM_PHASES; ++p)
+				fprintf(g_frameTimesCsv, ",%.4f", t.gpu[p]);
+			fprintf(g_frameTimesCsv, "\n");
+		}
+
+		++g_timedFrames;
+		g_cpuFrameMs += t.cpuFrame;
+		for (int p = 0; p < FP_NUM_PHASES; ++p)
+			g_cpuPhaseMs[p] += t.cpu[p];
+		if (t.gpuFrame >= 0) {
+			++g_gpuTimedFrames;
+			g_gpuBoundFrames += t.gpuBound();
+			g_gpuBusyMs += t.gpuBusy();
+			for (int p = 0; p < FP_NUM_PHASES; ++p)
+				g_gpuPhaseMs[p] += t.gpu[p];
+		}
+	}
+}
+
+// Average times per frame since the last report
+static void reportFrameTimes() {
+	if (g_timedFrames == 0)
+		return;
+	char line[64];
+	sprintf(line, "Frame times: CPU %.2f ms", g_cpuFrameMs / g_timedFrames);
+	cout << line;
+	const bool gpuTimed = g_gpuTimedFrames > 0;
+	if (gpuTimed) {
+		sprintf(line, ", GPU %.2f ms", g_gpuBusyMs / g_gpuTimedFrames);
+		cout << line << ", GPU bound in " << g_gpuBoundFrames << " of " << g_gpuTimedFrames << " frames";
+	}
+	cout << "\n ";
+	for (int p = 0; p < FP_NUM_PHASES; ++p) {
+		sprintf(line, " %s %.2f", g_framePhaseNames[p], g_cpuPhaseMs[p] / g_timedFrames);
+		cout << line;
+		if (gpuTimed) {
+			sprintf(line, "/%.2f", g_gpuPhaseMs[p] / g_gpuTimedFrames);
+			cout << line;
+		}
+	}
+	cout << (gpuTimed ? " ms (CPU/GPU)" : " ms");
+	if (g_frameTimer->dropped() > 0)
+		cout << ", " << g_frameTimer->dropped() << " frames with no GPU times so far";
+	cout << endl;
+
+	g_timedFrames = g_gpuTimedFrames = g_gpuBoundFrames = 0;
+	g_cpuFrameMs = g_gpuBusyMs = 0;
+	for (int p = 0; p < FP_NUM_PHASES; ++p)
+		g_cpuPhaseMs[p] = g_gpuPhaseMs[p] = 0;
+}
+
+// Draws a frame, one simulation step, into the framebuffer bound
+static void renderFrame() {
+	if (g_frameTimer)
+		g_frameTimer->beginFrame();
+	beginFramePhase(FP_CLEAR);
+	g_glState.useProgram(particleShaderState(false).program);
 	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);                   // clear framebuffer color&depth
+	endFramePhase();
 
 	drawStuff();
+	if (g_showHud && g_hudShaderState) {
+		beginFramePhase(FP_HUD);
+		drawHud();
+		endFramePhase();
+	}
+	beginFramePhase(FP_READBACK);
+	updateFrameReadbacks();
+	endFramePhase();
+	if (g_frameTimer)
+		g_frameTimer->endFrame();
+	collectFrameTimes(false);
+
+	if (!g_posterFile.empty()) {
+		try {
+			renderPoster(g_posterFile, g_posterWidth > 0 ? g_posterWidth : 4 * g_windowWidth,
+				g_posterHeight > 0 ? g_posterHeight : 4 * g_windowHeight);
+		}
+		catch (const runtime_error& e) {
+			cout << e.what() << endl;
+		}
+		g_posterFile.clear();
+	}
+}
+
+static void reportFrameStats() {
+	// report the average number of redundant state changes dropped per frame
+	if (g_simStep % g_cullReportSteps == 0) {
+		cout << "GL state cache: " << g_glState.skipped() / g_cullReportSteps << " of "
+			<< (g_glState.issued() + g_glState.skipped()) / g_cullReportSteps << " state changes per frame skipped" << endl;
+		g_glState.resetCounters();
+		if (g_capturing)
+			reportCapture();
+		reportFrameTimes();
+	}
+}
+
+static void display() {
+	renderFrame();
 
 	glutSwapBuffers();                                    // show the back buffer (where we rendered stuff)
 
+	reportFrameStats();
 	checkGlErrors();
+
+	// the particles keep moving: ask GLUT for the next frame (only here, as
+	// the batch and poster renders have no GLUT window)
+	glutPostRedisplay();
 }
 
-static void reshape(const int w, const int h) {
+static void resize(const int w, const int h) {
 	g_windowWidth = w;
 	g_windowHeight = h;
 	glViewport(0, 0, w, h);
@@ -444,9 +2112,56 @@ static void reshape(const int w, const int h) {
 
 	cerr << "Size of window is now " << w << "x" << h << endl;
 	updateFrustFovY();
+}
+
+static void reshape(const int w, const int h) {
+	resize(w, h);
 	glutPostRedisplay();
 }
 
+// Batch mode (--batch): frames are drawn with no window into a framebuffer
+// object of any size, one simulation step each, and written as a numbered PPM
+// (or QOI) sequence
+static int g_batchFrames = 0;
+static int g_batchWidth = 1280, g_batchHeight = 720;
+static string g_batchPrefix = "frame";
+
+static void renderBatch() {
+	GlRenderbuffer color, depth;
+	glBindRenderbuffer(GL_RENDERBUFFER, color);
+	glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, g_batchWidth, g_batchHeight);
+	glBindRenderbuffer(GL_RENDERBUFFER, depth);
+	glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, g_batchWidth, g_batchHeight);
+
+	GlFramebuffer fbo;
+	glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+	glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, color);
+	glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, depth);
+	if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+		throw runtime_error("Framebuffer for batch rendering is incomplete");
+	glDrawBuffer(GL_COLOR_ATTACHMENT0);
+	glReadBuffer(GL_COLOR_ATTACHMENT0);
+	resize(g_batchWidth, g_batchHeight);
+
+	cout << "Rendering " << g_batchFrames << " frames at " << g_batchWidth << "x" << g_batchHeight
+		<< " through " << offscreenContextKind() << endl;
+	for (int i = 0; i < g_batchFrames; ++i) {
+		char number[16];
+		sprintf(number, "%05d", i);
+		g_screenshotFile = g_batchPrefix + number + "." + g_imageFormat;
+		renderFrame();
+		reportFrameStats();
+		checkGlErrors();
+	}
+
+	collectFrameReadbacks(true);
+	collectFrameTimes(true);
+	g_ioThread.reset();  // waits until everything is written
+	if (g_capturing)
+		reportCapture();
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+}
+
 static void motion(const int x, const int y) {
 
 	glutPostRedisplay(); // we always redraw if we changed the scene
@@ -486,7 +2201,16 @@ static void keyboard(const unsigned char key, const int x, const int y) {
 		cout << " ============== H E L P ==============\n\n"
 			<< "h\t\thelp menu\n"
 			<< "s\t\tsave screenshot\n"
+			<< "P\t\tsave a poster of the frame (" << (g_posterWidth > 0 ? g_posterWidth : 4 * g_windowWidth) << "x"
+			<< (g_posterHeight > 0 ? g_posterHeight : 4 * g_windowHeight) << ", to poster.ppm)\n"
+			<< "r\t\tToggle continuous capture of every frame (to " << g_captureFilename << ")\n"
 			<< "f\t\tToggle flat shading on/off.\n"
+			<< "p\t\tCycle particle backend (cpu, closed-form, compute)\n"
+			<< "c\t\tToggle frustum culling of particles (cpu and compute backends)\n"
+			<< "l\t\tToggle sphere level of detail by screen size (cpu backend)\n"
+			<< "i\t\tToggle ray-cast sphere impostors (cpu and compute backends)\n"
+			<< "k\t\tToggle flipbook fire and smoke sprites (cpu and compute backends)\n"
+			<< "t\t\tToggle the frame timing graph (GPU time by phase on the left of each frame, CPU on the right)\n"
 			<< "o\t\tCycle object to edit\n"
 			<< "v\t\tCycle view\n"
 			<< "m\t\Cycles through world-sky and sky-sky frames\n"
@@ -494,12 +2218,49 @@ static void keyboard(const unsigned char key, const int x, const int y) {
 			<< "drag right mouse to translate\n" << endl;
 		break;
 	case 's':
-		glFlush();
-		writePpmScreenshot(g_windowWidth, g_windowHeight, "out.ppm");
+		g_screenshotFile = "out." + g_imageFormat;
+		break;
+	case 'P':
+		g_posterFile = "poster.ppm";
+		break;
+	case 'r':
+		toggleCapture();
 		break;
 	case 'f':
 		g_activeShader ^= 1;
 		break;
+	case 'p':
+		cycleParticleBackend();
+		break;
+	case 'c':
+		g_cullParticles = !g_cullParticles;
+		g_drawnSinceReport = g_culledSinceReport = 0;
+		cout << "Frustum culling " << (g_cullParticles ? "on" : "off") << endl;
+		break;
+	case 'l':
+		g_particleLod = !g_particleLod;
+		cout << "Sphere level of detail " << (g_particleLod ? "on" : "off") << endl;
+		break;
+	case 'i':
+		if (g_impostorShaderState) {
+			g_particleImpostors = !g_particleImpostors;
+			g_particleSprites = false;
+			cout << "Sphere impostors " << (g_particleImpostors ? "on" : "off") << endl;
+		}
+		break;
+	case 't':
+		if (g_hudShaderState) {
+			g_showHud = !g_showHud;
+			cout << "Frame timing graph " << (g_showHud ? "on" : "off") << endl;
+		}
+		break;
+	case 'k':
+		if (g_spriteShaderState) {
+			g_particleSprites = !g_particleSprites;
+			g_particleImpostors = false;
+			cout << "Flipbook sprites " << (g_particleSprites ? "on" : "off") << endl;
+		}
+		break;
 	case ' ':
 		g_spaceDown = true;
 		break;
@@ -533,32 +2294,263 @@ static void initGLState() {
 	glClearDepth(0.);
 	glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
 	glPixelStorei(GL_PACK_ALIGNMENT, 1);
-	glEnable(GL_BLEND);
-	glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
 	glDepthFunc(GL_GREATER);
 	glReadBuffer(GL_BACK);
-	if (!g_Gl2Compatible)
-		glEnable(GL_FRAMEBUFFER_SRGB);
+	glEnable(GL_FRAMEBUFFER_SRGB);
 }
 
+// Every program is started before any is waited on, and comes from the binary
+// cache in g_shaderCacheDir when it can
 static void initShaders() {
-	g_shaderStates.resize(g_numShaders);
-	for (int i = 0; i < g_numShaders; ++i) {
-		if (g_Gl2Compatible)
-			g_shaderStates[i].reset(new ShaderState(g_shaderFilesGl2[i][0], g_shaderFilesGl2[i][1]));
-		else
-			g_shaderStates[i].reset(new ShaderState(g_shaderFiles[i][0], g_shaderFiles[i][1]));
+	ProgramCache cache(g_shaderCacheDir);
+
+	g_shaderStates.resize(PF_NUM_VARIANTS);
+	for (int i = 0; i < PF_NUM_VARIANTS; ++i) {
+		string defines;
+		for (int f = 0; f < g_numParticleFeatures; ++f) {
+			if (i & (1 << f))
+				defines += string(defines.empty() ? "" : " ") + g_particleFeatureNames[f];
+		}
+		g_shaderStates[i].reset(new ShaderState(cache, g_shaderFiles[0], g_shaderFiles[1], defines));
+	}
+	g_impostorShaderState.reset(new ShaderState(cache, g_impostorShaderFiles[0], g_impostorShaderFiles[1]));
+	g_spriteShaderState.reset(new ShaderState(cache, g_spriteShaderFiles[0], g_spriteShaderFiles[1]));
+	g_hudShaderState.reset(new HudShaderState(cache, g_hudShaderFiles[0], g_hudShaderFiles[1]));
+	g_closedFormShaderState.reset(new ClosedFormShaderState(cache, g_closedFormShaderFiles[0], g_closedFormShaderFiles[1]));
+
+	// shader storage buffers and compute shaders need GL 4.3
+#ifndef __MAC__
+	if (GLEW_VERSION_4_3) {
+		g_particleUpdateShaderState.reset(new ParticleUpdateShaderState(cache, g_particleUpdateShaderFile));
+		g_particleCullShaderState.reset(new ParticleCullShaderState(cache, g_particleCullShaderFile));
+	}
+#endif
+
+	cache.finish();
+	for (int i = 0; i < PF_NUM_VARIANTS; ++i)
+		g_shaderStates[i]->init();
+	if (g_impostorShaderState)
+		g_impostorShaderState->init();
+	if (g_spriteShaderState)
+		g_spriteShaderState->init();
+	if (g_hudShaderState)
+		g_hudShaderState->init();
+	if (g_closedFormShaderState)
+		g_closedFormShaderState->init();
+#ifndef __MAC__
+	if (g_particleUpdateShaderState) {
+		g_particleUpdateShaderState->init();
+		g_particleCullShaderState->init();
+	}
+#endif
+	cout << "Shader programs: " << cache.loaded() << " from the binary cache, " << cache.compiled() << " compiled" << endl;
+}
+
+// Loads the sprite frames into an atlas, whose mip levels are built on the CPU
+// and go to the GL together through one pixel unpack buffer
+static void initSpriteTexture() {
+	const SpriteAtlas atlas(vector<string>(g_spriteFiles, g_spriteFiles + g_numRamps * g_numSpriteFrames));
+
+	GlBufferObject pbo;
+	g_glState.bindBuffer(GL_PIXEL_UNPACK_BUFFER, pbo);
+	glBufferData(GL_PIXEL_UNPACK_BUFFER, atlas.data().size(), &atlas.data()[0], GL_STREAM_DRAW);
+
+	g_spriteTexture.reset(new GlTexture);
+	glBindTexture(GL_TEXTURE_2D, *g_spriteTexture);
+	for (int level = 0; level < atlas.levels(); ++level) {
+		glTexImage2D(GL_TEXTURE_2D, level, GL_RGBA8, atlas.width(level), atlas.height(level), 0, GL_RGBA, GL_UNSIGNED_BYTE,
+			reinterpret_cast<const GLvoid*>(atlas.offset(level)));
+	}
+	g_glState.bindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+
+	// the chain stops where a cell is one pixel, short of a 1x1 atlas
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, atlas.levels() - 1);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+
+	const GLuint h = g_spriteShaderState->program;
+	g_glState.useProgram(h);
+	safe_glUniform1i(safe_glGetUniformLocation(h, "uSprites"), 1);
+	safe_glUniform2f(safe_glGetUniformLocation(h, "uSpriteGrid"), atlas.columns(), atlas.rows());
+	safe_glUniform1i(safe_glGetUniformLocation(h, "uSpriteFrames"), g_numSpriteFrames);
+	checkGlErrors();
+
+	cout << "Sprite atlas: " << atlas.frames() << " frames in " << atlas.columns() << "x" << atlas.rows() << " cells of "
+		<< atlas.cellSize() << " pixels, " << atlas.levels() << " mip levels" << endl;
+}
+
+// Stack the ramp images into a 1D array texture. Each PPM has two rows: the top
+// row is the color and the bottom row (as gray) the opacity over age/life
+static void initTextures() {
+	int width = 0;
+	vector<unsigned char> rgba;
+	for (int layer = 0; layer < g_numRamps; ++layer) {
+		// read in place from the mapped file
+		PpmImage ramp(g_rampFiles[layer]);
+		const int w = ramp.width();
+		if (ramp.height() != 2 || (layer > 0 && w != width))
+			throw runtime_error(string("Ramp ") + g_rampFiles[layer] + " must be two rows of the same width as the others");
+		width = w;
+
+		for (int i = 0; i < w; ++i) {
+			const PackedPixel& color = ramp.row(0)[i];
+			const PackedPixel& opacity = ramp.row(1)[i];
+			rgba.push_back(color.r);
+			rgba.push_back(color.g);
+			rgba.push_back(color.b);
+			rgba.push_back(opacity.r);
+		}
 	}
+
+	g_rampTexture.reset(new GlTexture);
+	glBindTexture(GL_TEXTURE_1D_ARRAY, *g_rampTexture);
+	glTexImage2D(GL_TEXTURE_1D_ARRAY, 0, GL_RGBA8, width, g_numRamps, 0, GL_RGBA, GL_UNSIGNED_BYTE, &rgba[0]);
+	glTexParameteri(GL_TEXTURE_1D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_1D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_1D_ARRAY, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	checkGlErrors();
+
+	if (g_spriteShaderState)
+		initSpriteTexture();
 }
 
 static void initGeometry() {
+	initMeshArenas();
 	initGround();
 	initParticles();
+	cout << "Static meshes: " << g_vertexArena->used() << " bytes of vertices, "
+		<< g_indexArena->used() << " bytes of indices in shared buffers" << endl;
+	if (g_closedFormShaderState)
+		initClosedFormParticles();
+#ifndef __MAC__
+	if (g_particleUpdateShaderState)
+		initComputeParticles();
+#endif
+	if (g_hudShaderState)
+		initHud();
+}
+
+// Times writing an image as PPM and as QOI, reporting the throughput in raw
+// pixel bytes per second and the size of each file, and checks that the QOI
+// file decodes back to the same pixels. Returns whether it does
+static bool benchmarkImageFormats(const char *filename, int iterations) {
+	int width, height;
+	vector<PackedPixel> image;
+	ppmRead(filename, width, height, image);  // rows bottom to top, as read back from GL
+	const unsigned char *pixels = reinterpret_cast<const unsigned char *>(&image[0]);
+	const double rawBytes = 3.0 * width * height;
+	iterations = max(iterations, 1);
+
+	clock_t start = clock();
+	for (int i = 0; i < iterations; ++i)
+		writePpm("benchmark.ppm", width, height, pixels);
+	const double ppmSeconds = double(clock() - start) / CLOCKS_PER_SEC / iterations;
+	const double ppmBytes = MappedFile("benchmark.ppm").size();
+
+	vector<unsigned char> encoded;
+	start = clock();
+	for (int i = 0; i < iterations; ++i) {
+		encoded.clear();
+		qoiEncode(pixels, width, height, encoded);
+	}
+	const double encodeSeconds = double(clock() - start) / CLOCKS_PER_SEC / iterations;
+
+	start = clock();
+	for (int i = 0; i < iterations; ++i)
+		writeQoi("benchmark.qoi", width, height, pixels);
+	const double qoiSeconds = double(clock() - start) / CLOCKS_PER_SEC / iterations;
+
+	int decodedWidth, decodedHeight;
+	vector<PackedPixel> decoded;
+	start = clock();
+	for (int i = 0; i < iterations; ++i)
+		qoiRead("benchmark.qoi", decodedWidth, decodedHeight, decoded);
+	const double decodeSeconds = double(clock() - start) / CLOCKS_PER_SEC / iterations;
+
+	bool same = decodedWidth == width && decodedHeight == height;
+	for (int y = 0; same && y < height; ++y)
+		same = memcmp(&decoded[(size_t)y * width], &image[(size_t)(height - 1 - y) * width], width * sizeof(PackedPixel)) == 0;
+
+	const double mb = 1024 * 1024;
+	cout << width << "x" << height << " image, " << iterations << " iterations\n"
+		<< "PPM write:  " << rawBytes / mb / ppmSeconds << " MB/s, " << ppmBytes << " bytes\n"
+		<< "QOI encode: " << rawBytes / mb / encodeSeconds << " MB/s\n"
+		<< "QOI write:  " << rawBytes / mb / qoiSeconds << " MB/s, " << encoded.size() << " bytes, "
+		<< ppmBytes / encoded.size() << "x smaller than PPM\n"
+		<< "QOI read:   " << rawBytes / mb / decodeSeconds << " MB/s, " << (same ? "same pixels" : "PIXELS DIFFER") << endl;
+	return same;
 }
 
 int main(int argc, char * argv[]) {
 	try {
-		initGlutState(argc, argv);
+		// --capture file: capture every frame from the start, as by 'r'. With "-",
+		// frames go to stdout and the console output to stderr.
+		// --capture-format raw|y4m: overrides the format chosen by the file name.
+		// --capture-wait: wait for the I/O thread rather than drop frames
+		for (int i = 1; i < argc; ++i) {
+			if (strcmp(argv[i], "--capture") == 0 && i + 1 < argc) {
+				g_captureFilename = argv[++i];
+				if (g_captureFilename == "-")
+					cout.rdbuf(cerr.rdbuf());
+				toggleCapture();
+			}
+			else if (strcmp(argv[i], "--capture-format") == 0 && i + 1 < argc)
+				g_captureFormat = argv[++i];
+			else if (strcmp(argv[i], "--capture-wait") == 0)
+				g_captureWait = true;
+		}
+
+		// --batch frames [--size WxH] [--batch-prefix name]: render with no
+		// window into name00000.ppm, name00001.ppm, ... and exit.
+		// --image-format ppm|qoi: file format of the batch frames and screenshots
+		// --benchmark-image-formats image.ppm [iterations]: compare the formats
+		// on an image and exit
+		// --poster file.ppm [--poster-size WxH]: render with no window a poster
+		// of the last batch frame (or of the initial state, with no --batch) and
+		// exit. The size also applies to the posters saved with 'P'
+		// --shader-cache dir: where to keep program binaries (default
+		// shadercache); --no-shader-cache: always compile the shaders
+		// --frame-times file.csv: write the CPU and GPU times of every frame;
+		// --hud: start with the frame timing graph shown, as by 't'
+		string posterFile;
+		for (int i = 1; i < argc; ++i) {
+			if (strcmp(argv[i], "--batch") == 0 && i + 1 < argc)
+				g_batchFrames = atoi(argv[++i]);
+			else if (strcmp(argv[i], "--size") == 0 && i + 1 < argc) {
+				if (sscanf(argv[++i], "%dx%d", &g_batchWidth, &g_batchHeight) != 2 || g_batchWidth <= 0 || g_batchHeight <= 0)
+					throw runtime_error("Error: --size takes WIDTHxHEIGHT");
+			}
+			else if (strcmp(argv[i], "--poster") == 0 && i + 1 < argc)
+				posterFile = argv[++i];
+			else if (strcmp(argv[i], "--poster-size") == 0 && i + 1 < argc) {
+				if (sscanf(argv[++i], "%dx%d", &g_posterWidth, &g_posterHeight) != 2 || g_posterWidth <= 0 || g_posterHeight <= 0)
+					throw runtime_error("Error: --poster-size takes WIDTHxHEIGHT");
+			}
+			else if (strcmp(argv[i], "--shader-cache") == 0 && i + 1 < argc)
+				g_shaderCacheDir = argv[++i];
+			else if (strcmp(argv[i], "--no-shader-cache") == 0)
+				g_shaderCacheDir.clear();
+			else if (strcmp(argv[i], "--frame-times") == 0 && i + 1 < argc)
+				openFrameTimesCsv(argv[++i]);
+			else if (strcmp(argv[i], "--hud") == 0)
+				g_showHud = true;
+			else if (strcmp(argv[i], "--batch-prefix") == 0 && i + 1 < argc)
+				g_batchPrefix = argv[++i];
+			else if (strcmp(argv[i], "--image-format") == 0 && i + 1 < argc) {
+				g_imageFormat = argv[++i];
+				if (g_imageFormat != "ppm" && g_imageFormat != "qoi")
+					throw runtime_error("Error: --image-format takes ppm or qoi");
+			}
+			else if (strcmp(argv[i], "--benchmark-image-formats") == 0 && i + 1 < argc)
+				return benchmarkImageFormats(argv[i + 1], i + 2 < argc ? atoi(argv[i + 2]) : 10) ? 0 : 1;
+		}
+
+		if (g_batchFrames > 0 || !posterFile.empty())
+			createOffscreenContext();
+		else
+			initGlutState(argc, argv);
 
 		// on Mac, we shouldn't use GLEW.
 
@@ -566,19 +2558,45 @@ int main(int argc, char * argv[]) {
 		glewInit(); // load the OpenGL extensions
 #endif
 
-		cout << (g_Gl2Compatible ? "Will use OpenGL 2.x / GLSL 1.0" : "Will use OpenGL 3.x / GLSL 1.5") << endl;
+		cout << "Will use OpenGL 3.3 / GLSL 1.5" << endl;
 
 #ifndef __MAC__
-		if ((!g_Gl2Compatible) && !GLEW_VERSION_3_0)
-			throw runtime_error("Error: card/driver does not support OpenGL Shading Language v1.3");
-		else if (g_Gl2Compatible && !GLEW_VERSION_2_0)
-			throw runtime_error("Error: card/driver does not support OpenGL Shading Language v1.0");
+		// instance divisors, uniform blocks, base vertex draws and packed
+		// 10-bit normals, which every GL3 particle path uses, need GL 3.3
+		if (!GLEW_VERSION_3_3)
+			throw runtime_error("Error: card/driver does not support OpenGL 3.3");
 #endif
 
 		initGLState();
 		initShaders();
+		initUniformBlocks();
 		initGeometry();
+		initTextures();
+
+		// --validate-compute [steps]: check the compute backend against the CPU
+		// reference and exit, e.g. on a GPU-less host with LIBGL_ALWAYS_SOFTWARE=1
+		for (int i = 1; i < argc; ++i) {
+			if (strcmp(argv[i], "--validate-compute") == 0) {
+#ifndef __MAC__
+				if (!g_particleUpdateShaderState)
+					throw runtime_error("Error: --validate-compute needs OpenGL 4.3 compute shaders");
+				return validateComputeParticles(i + 1 < argc ? atoi(argv[i + 1]) : 100) ? 0 : 1;
+#else
+				throw runtime_error("Error: --validate-compute is not supported on this platform");
+#endif
+			}
+		}
 
+		g_glState.resetCounters();  // count frames only
+		g_frameTimer.reset(new FrameTimer(FP_NUM_PHASES, g_frameTimerLatency));
+		if (g_batchFrames > 0 || !posterFile.empty()) {
+			if (g_batchFrames > 0)
+				renderBatch();
+			if (!posterFile.empty())
+				renderPoster(posterFile, g_posterWidth > 0 ? g_posterWidth : 4 * g_windowWidth,
+					g_posterHeight > 0 ? g_posterHeight : 4 * g_windowHeight);
+			return 0;
+		}
 		glutMainLoop();
 		return 0;
 	}
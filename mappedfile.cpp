@@ -0,0 +1,83 @@
+#include <stdexcept>
+#include <string>
+
+#ifdef _WIN32
+# include <windows.h>
+#else
+# include <fcntl.h>
+# include <sys/mman.h>
+# include <sys/stat.h>
+# include <unistd.h>
+#endif
+
+#include "mappedfile.h"
+
+using namespace std;
+
+#ifdef _WIN32
+
+MappedFile::MappedFile(const char *filename) : data_(NULL), size_(0), file_(INVALID_HANDLE_VALUE), mapping_(NULL) {
+  file_ = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+  if (file_ == INVALID_HANDLE_VALUE)
+    throw runtime_error(string("MappedFile: Cannot open file ") + filename + " for read");
+
+  LARGE_INTEGER size;
+  if (!GetFileSizeEx(file_, &size)) {
+    CloseHandle(file_);
+    throw runtime_error(string("MappedFile: Cannot get the size of ") + filename);
+  }
+  size_ = (size_t)size.QuadPart;
+  if (size_ == 0)
+    return;
+
+  mapping_ = CreateFileMappingA(file_, NULL, PAGE_READONLY, 0, 0, NULL);
+  if (mapping_)
+    data_ = (const unsigned char *)MapViewOfFile(mapping_, FILE_MAP_READ, 0, 0, 0);
+  if (!data_) {
+    if (mapping_)
+      CloseHandle(mapping_);
+    CloseHandle(file_);
+    throw runtime_error(string("MappedFile: Cannot map ") + filename);
+  }
+}
+
+MappedFile::~MappedFile() {
+  if (data_)
+    UnmapViewOfFile(data_);
+  if (mapping_)
+    CloseHandle(mapping_);
+  CloseHandle(file_);
+}
+
+#else
+
+MappedFile::MappedFile(const char *filename) : data_(NULL), size_(0) {
+  const int fd = open(filename, O_RDONLY);
+  if (fd < 0)
+    throw runtime_error(string("MappedFile: Cannot open file ") + filename + " for read");
+
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    close(fd);
+    throw runtime_error(string("MappedFile: Cannot get the size of ") + filename);
+  }
+  size_ = st.st_size;
+
+  if (size_ > 0) {
+    void *p = mmap(NULL, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (p == MAP_FAILED) {
+      close(fd);
+      throw runtime_error(string("MappedFile: Cannot map ") + filename);
+    }
+    data_ = (const unsigned char *)p;
+    madvise(p, size_, MADV_SEQUENTIAL);
+  }
+  close(fd);  // the mapping stays valid
+}
+
+MappedFile::~MappedFile() {
+  if (data_)
+    munmap((void *)data_, size_);
+}
+
+#endif
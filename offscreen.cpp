@@ -0,0 +1,104 @@
+#include <cstring>
+#include <stdexcept>
+#include <string>
+
+#if defined(OFFSCREEN_EGL)
+# include <EGL/egl.h>
+# include <EGL/eglext.h>
+#elif defined(OFFSCREEN_OSMESA)
+# include <GL/osmesa.h>
+#endif
+
+#include "offscreen.h"
+
+using namespace std;
+
+#if defined(OFFSCREEN_EGL)
+
+// Without a window system, Mesa's surfaceless platform is preferred; otherwise
+// the default display, which EGL_PLATFORM can point anywhere
+static EGLDisplay getOffscreenDisplay() {
+  const char *clientExtensions = eglQueryString(EGL_NO_DISPLAY, EGL_EXTENSIONS);
+  if (clientExtensions && strstr(clientExtensions, "EGL_MESA_platform_surfaceless")) {
+    PFNEGLGETPLATFORMDISPLAYEXTPROC getPlatformDisplay =
+      (PFNEGLGETPLATFORMDISPLAYEXTPROC)eglGetProcAddress("eglGetPlatformDisplayEXT");
+    if (getPlatformDisplay) {
+      EGLDisplay display = getPlatformDisplay(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, NULL);
+      if (display != EGL_NO_DISPLAY)
+        return display;
+    }
+  }
+  return eglGetDisplay(EGL_DEFAULT_DISPLAY);
+}
+
+void createOffscreenContext() {
+  EGLDisplay display = getOffscreenDisplay();
+  if (display == EGL_NO_DISPLAY || !eglInitialize(display, NULL, NULL))
+    throw runtime_error("createOffscreenContext: Cannot initialize EGL");
+
+  const char *extensions = eglQueryString(display, EGL_EXTENSIONS);
+  if (!extensions || !strstr(extensions, "EGL_KHR_surfaceless_context"))
+    throw runtime_error("createOffscreenContext: EGL lacks EGL_KHR_surfaceless_context");
+  if (!eglBindAPI(EGL_OPENGL_API))
+    throw runtime_error("createOffscreenContext: EGL cannot bind desktop OpenGL");
+
+  // no surface is ever made, so any surface type will do (not just windows)
+  const EGLint configAttribs[] = { EGL_SURFACE_TYPE, 0, EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT, EGL_NONE };
+  EGLConfig config;
+  EGLint numConfigs = 0;
+  if (!eglChooseConfig(display, configAttribs, &config, 1, &numConfigs) || numConfigs == 0)
+    throw runtime_error("createOffscreenContext: No EGL config for desktop OpenGL");
+
+  // a compatibility context of the highest version, as a GLUT window gets
+  const EGLint contextAttribs[] = {
+    EGL_CONTEXT_OPENGL_PROFILE_MASK, EGL_CONTEXT_OPENGL_COMPATIBILITY_PROFILE_BIT,
+    EGL_NONE
+  };
+  EGLContext context = eglCreateContext(display, config, EGL_NO_CONTEXT, contextAttribs);
+  if (context == EGL_NO_CONTEXT)
+    throw runtime_error("createOffscreenContext: Cannot create EGL context");
+  if (!eglMakeCurrent(display, EGL_NO_SURFACE, EGL_NO_SURFACE, context))
+    throw runtime_error("createOffscreenContext: Cannot make EGL context current");
+}
+
+const char *offscreenContextKind() {
+  return "EGL";
+}
+
+#elif defined(OFFSCREEN_OSMESA)
+
+void createOffscreenContext() {
+  // OSMesa wants a color buffer to make the context current, but nothing is
+  // ever drawn to it
+  static unsigned char unused[4];
+
+  const int attribs[] = {
+    OSMESA_FORMAT, OSMESA_RGBA,
+    OSMESA_DEPTH_BITS, 0,
+    OSMESA_PROFILE, OSMESA_COMPAT_PROFILE,
+    OSMESA_CONTEXT_MAJOR_VERSION, 3,
+    OSMESA_CONTEXT_MINOR_VERSION, 0,
+    0
+  };
+  OSMesaContext context = OSMesaCreateContextAttribs(attribs, NULL);
+  if (!context)
+    throw runtime_error("createOffscreenContext: Cannot create OSMesa context");
+  if (!OSMesaMakeCurrent(context, unused, GL_UNSIGNED_BYTE, 1, 1))
+    throw runtime_error("createOffscreenContext: Cannot make OSMesa context current");
+}
+
+const char *offscreenContextKind() {
+  return "OSMesa";
+}
+
+#else
+
+void createOffscreenContext() {
+  throw runtime_error("createOffscreenContext: Built without offscreen support (make EGL=1 or OSMESA=1)");
+}
+
+const char *offscreenContextKind() {
+  return "none";
+}
+
+#endif
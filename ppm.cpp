@@ -1,6 +1,7 @@
 #include <cstdlib>
 #include <cstring>
 #include <cstdio>
+#include <cctype>
 #include <fstream>
 #include <iostream>
 #include <vector>
@@ -16,27 +17,67 @@
 
 #include "ppm.h"
 
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#  include <emmintrin.h>
+#  define PPM_USE_SSE2
+#  ifdef _MSC_VER
+#    include <intrin.h>
+#  endif
+#endif
+
 using namespace std;
 
 void writePpmScreenshot(const int width, const int height, const char *filename) {
-  vector<char> image(width*height*3);
+  vector<unsigned char> image(width*height*3);
 
   glReadPixels(0,0, width, height, GL_RGB, GL_UNSIGNED_BYTE, &image[0]);
 
+  writePpm(filename, width, height, &image[0]);
+}
+
+void writePpm(const char *filename, int width, int height, const unsigned char *pixels) {
   ofstream f(filename, ios::binary);
+  if (!f.is_open())
+    throw runtime_error(string("writePpm: Cannot open file ") + filename + " for write");
+
   f << "P6 " << width << " " << height << " 255\n";
   for (int i = 0; i < height; ++i) {
-    f.write(&image[3*width*(height-1-i)], 3*width);
+    f.write(reinterpret_cast<const char*>(pixels + 3*width*(height-1-i)), 3*width);
+  }
+  if (!f)
+    throw runtime_error(string("writePpm: Cannot write file ") + filename);
+}
+
+PpmStreamWriter::PpmStreamWriter(const char *filename, int width, int height)
+  : file_(filename, ios::binary), filename_(filename), width_(width), height_(height), written_(0) {
+  if (!file_.is_open())
+    throw runtime_error(string("writePpm: Cannot open file ") + filename + " for write");
+  file_ << "P6 " << width << " " << height << " 255\n";
+}
+
+void PpmStreamWriter::writeRows(const unsigned char *pixels, int rows) {
+  if (written_ + rows > height_)
+    throw runtime_error(string("writePpm: Too many rows for file ") + filename_);
+  for (int i = 0; i < rows; ++i) {
+    file_.write(reinterpret_cast<const char*>(pixels + 3*width_*(rows-1-i)), 3*width_);
   }
+  written_ += rows;
+  if (!file_)
+    throw runtime_error(string("writePpm: Cannot write file ") + filename_);
+}
+
+void PpmStreamWriter::close() {
+  file_.close();
+  if (!file_ || written_ != height_)
+    throw runtime_error(string("writePpm: Cannot write file ") + filename_);
 }
 
-// Read one positive integer from a (text) file. Line beginning with
-// "#" are ignored as comments.
-static int ppmReadInteger(istream& is) {
-  unsigned char ch;
-  int got = 0, done = 0, accum = 0, inComment = 0;
-  while (!done) {
-    ch = is.get();
+// Read one positive integer from the text in [p, end), leaving p just past the
+// character that ends it. Lines beginning with "#" are ignored as comments.
+static int ppmParseInteger(const unsigned char *&p, const unsigned char *end) {
+  int got = 0, accum = 0, inComment = 0;
+  for (; p < end; ++p) {
+    const unsigned char ch = *p;
 
     if (inComment) {
       if (ch=='\n')
@@ -52,65 +93,154 @@ static int ppmReadInteger(istream& is) {
       inComment=1;
     else if (!ch || !strchr(" \t\r\n", ch))
       throw runtime_error("ppmRead: invalid character");
-    else if (got)
-      done = 1;
-    else
-      ; // nothing
+    else if (got) {
+      ++p;
+      return accum;
+    }
   }
+  if (!got)
+    throw runtime_error("ppmRead: unexpected end of file");
   return accum;
 }
 
-// Read the PPM header from the input stream and initialize the width and height
-// to the appropriate values, and throws rumtime_error on invalid width/height
-static void ppmReadHeader(istream& is, int &width, int &height) {
-  if ((width = ppmReadInteger(is)) < 0) {
+// Parse the PPM header at p, moving p to the pixel data, and initialize the
+// width and height to the appropriate values. Throws runtime_error on invalid
+// width/height
+static void ppmParseHeader(const unsigned char *&p, const unsigned char *end, int &width, int &height) {
+  if ((width = ppmParseInteger(p, end)) <= 0) {
     throw runtime_error("ppmRead: invalid width");
   }
-  if ((height = ppmReadInteger(is)) < 0) {
+  if ((height = ppmParseInteger(p, end)) <= 0) {
     throw runtime_error("ppmRead: invalid height");
   }
-  if (ppmReadInteger(is) != 255) {
+  if (ppmParseInteger(p, end) != 255) {
     cerr << "Warning: maxcolor not 255 : won't work well" << endl;
   }
 }
 
-//Reads the actual PPM data and stores returns in in a pixels.
-void ppmRead(const char *filename, int& width, int& height, std::vector<PackedPixel>& pixels) {
-  ifstream is(filename, ios::binary);
-  if (!is.is_open())
-    throw runtime_error(string("ppmRead: Cannot open file ") + filename + " for read");
+#ifdef PPM_USE_SSE2
+static inline int lowestBit(unsigned int m) {
+# ifdef _MSC_VER
+  unsigned long i;
+  _BitScanForward(&i, m);
+  return i;
+# else
+  return __builtin_ctz(m);
+# endif
+}
+
+static inline int highestBit(unsigned int m) {
+# ifdef _MSC_VER
+  unsigned long i;
+  _BitScanReverse(&i, m);
+  return i;
+# else
+  return 31 - __builtin_clz(m);
+# endif
+}
+#endif
+
+// Decode count whitespace separated ASCII samples at p into out. Sixteen bytes at
+// a time are classified into digits and whitespace with SSE2, and each number is
+// then read from its run of digits, so the cost is per number rather than per
+// character. Anything else, like a comment, is left to ppmParseInteger.
+static void ppmParseSamples(const unsigned char *p, const unsigned char *end, unsigned char *out, size_t count) {
+  size_t n = 0;
+
+#ifdef PPM_USE_SSE2
+  const __m128i zero = _mm_set1_epi8('0'), nine = _mm_set1_epi8(9);
+  const __m128i space = _mm_set1_epi8(' '), tab = _mm_set1_epi8('\t');
+  const __m128i cr = _mm_set1_epi8('\r'), lf = _mm_set1_epi8('\n');
+
+  while (n < count && end - p >= 16) {
+    const __m128i c = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+    const __m128i d = _mm_sub_epi8(c, zero);
+    const __m128i digit = _mm_cmpeq_epi8(_mm_min_epu8(d, nine), d);           // '0' to '9'
+    const __m128i white = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(c, space), _mm_cmpeq_epi8(c, tab)),
+                                       _mm_or_si128(_mm_cmpeq_epi8(c, cr), _mm_cmpeq_epi8(c, lf))); // as ppmParseInteger
+    if (_mm_movemask_epi8(_mm_or_si128(digit, white)) != 0xffff)
+      break;
+
+    // a run of digits reaching the end of the chunk is left for the next one,
+    // which starts where it does
+    unsigned int runs = _mm_movemask_epi8(digit);
+    int consumed = 16;
+    if (runs & 0x8000) {
+      const unsigned int spaces = ~runs & 0xffff;
+      if (!spaces)
+        break;
+      consumed = highestBit(spaces) + 1;
+      runs &= (1u << consumed) - 1;
+    }
+
+    // up to three digits are combined without branching on the length; the
+    // copy of the chunk has room for reading past the last digit
+    unsigned char chunk[16 + 2];
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(chunk), c);
+    chunk[16] = chunk[17] = '0';
+
+    while (runs && n < count) {
+      const int first = lowestBit(runs);
+      const int len = lowestBit(~(runs >> first));
+      const unsigned char *q = chunk + first;
+      unsigned int value;
+      if (len <= 3) {
+        static const unsigned int scale[4][3] = { {0, 0, 0}, {1, 0, 0}, {10, 1, 0}, {100, 10, 1} };
+        value = (q[0] - '0') * scale[len][0] + (q[1] - '0') * scale[len][1] + (q[2] - '0') * scale[len][2];
+      }
+      else {
+        value = 0;
+        for (int i = 0; i < len; ++i)
+          value = value * 10 + (q[i] - '0');
+      }
+      out[n++] = value;
+      runs &= ~(((1u << len) - 1) << first);
+      if (n == count)
+        consumed = first + len;
+    }
+    p += consumed;
+  }
+#endif
 
-  // Sets bits to report IO error using exception
-  is.exceptions(ios::eofbit | ios::failbit | ios::badbit);
+  for (; n < count; ++n)
+    out[n] = ppmParseInteger(p, end);
+}
 
-  char buf[2];
-  is.read(buf, 2);
+PpmImage::PpmImage(const char *filename) : file_(filename), pixels_(NULL) {
+  const unsigned char *p = file_.data(), *end = p + file_.size();
 
   bool isbinary = false;
-  if (!memcmp(buf, "P3", 2))
+  if (file_.size() >= 2 && !memcmp(p, "P3", 2))
     isbinary = false;
-  else if (!memcmp(buf, "P6", 2))
+  else if (file_.size() >= 2 && !memcmp(p, "P6", 2))
     isbinary = true;
   else
     throw runtime_error("ppmRead: bad file format");
+  p += 2;
 
-  ppmReadHeader(is, width, height);
-
-  pixels.resize(width * height);
+  ppmParseHeader(p, end, width_, height_);
 
+  const size_t numPixels = (size_t)width_ * height_;
   if (isbinary) {
-    for (int row = height - 1; row >= 0; row--) {
-      is.read(reinterpret_cast<char*>(&pixels[row * width]), width * sizeof(PackedPixel));
-    }
+    if ((size_t)(end - p) < numPixels * sizeof(PackedPixel))
+      throw runtime_error("ppmRead: file is truncated");
+    pixels_ = reinterpret_cast<const PackedPixel*>(p);
   }
   else {
-    for (int row = height - 1; row >= 0; row--) {
-      for (int l = 0; l < width; l++) {
-        PackedPixel &p = pixels[row * width + l];
-        p.r = ppmReadInteger(is);
-        p.g = ppmReadInteger(is);
-        p.b = ppmReadInteger(is);
-      }
-    }
+    decoded_.resize(numPixels);
+    ppmParseSamples(p, end, reinterpret_cast<unsigned char*>(&decoded_[0]), numPixels * 3);
+    pixels_ = &decoded_[0];
   }
 }
+
+//Reads the actual PPM data and stores returns in in a pixels.
+void ppmRead(const char *filename, int& width, int& height, std::vector<PackedPixel>& pixels) {
+  PpmImage image(filename);
+  width = image.width();
+  height = image.height();
+
+  // one bulk pass flipping the rows to bottom to top
+  pixels.resize((size_t)width * height);
+  for (int row = 0; row < height; ++row)
+    memcpy(&pixels[(size_t)(height - 1 - row) * width], image.row(row), width * sizeof(PackedPixel));
+}
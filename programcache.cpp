@@ -0,0 +1,337 @@
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <stdint.h>
+
+#ifdef _WIN32
+# include <direct.h>
+# include <windows.h>
+#else
+# include <sys/stat.h>
+# include <sys/types.h>
+# include <time.h>
+#endif
+
+#include "mappedfile.h"
+#include "programcache.h"
+
+using namespace std;
+
+#ifndef GL_COMPLETION_STATUS_KHR
+# define GL_COMPLETION_STATUS_KHR 0x91B1
+#endif
+
+static const char g_binaryMagic[4] = { 'P', 'B', 'I', 'N' };  // then the format, and the binary
+static const char g_fragDataName[] = "fragColor";  // the fragment shader output, bound to draw buffer 0
+
+// 64-bit FNV-1a, continuing from h
+static uint64_t hashBytes(const void *data, size_t size, uint64_t h) {
+  const unsigned char *p = static_cast<const unsigned char *>(data);
+  for (size_t i = 0; i < size; ++i) {
+    h ^= p[i];
+    h *= 1099511628211ULL;
+  }
+  return h;
+}
+
+// Hashes the string and its terminating zero, so that consecutive strings
+// cannot run into each other
+static uint64_t hashString(const string& s, uint64_t h) {
+  return hashBytes(s.c_str(), s.size() + 1, h);
+}
+
+static string readShaderFile(const char *filename) {
+  const MappedFile file(filename);
+  return string(reinterpret_cast<const char *>(file.data()), file.size());
+}
+
+string specializeShaderSource(const string& source, const string& defines) {
+  string lines;
+  for (size_t begin = defines.find_first_not_of(' '); begin != string::npos;) {
+    const size_t end = defines.find(' ', begin);
+    lines += "#define " + defines.substr(begin, end == string::npos ? string::npos : end - begin) + " 1\n";
+    begin = end == string::npos ? end : defines.find_first_not_of(' ', end);
+  }
+  if (lines.empty())
+    return source;
+
+  // after the #version line if there is one, keeping the line numbers of the
+  // rest for the compile errors
+  size_t at = 0;
+  const size_t version = source.find("#version");
+  if (version != string::npos && source.find_first_not_of(" \t\r\n", 0) == version) {
+    at = source.find('\n', version);
+    at = at == string::npos ? source.size() : at + 1;
+    lines += "#line 2\n";
+  }
+  return source.substr(0, at) + lines + source.substr(at);
+}
+
+// Moves from over to, which may exist already
+static bool replaceFile(const string& from, const string& to) {
+#ifdef _WIN32
+  return MoveFileExA(from.c_str(), to.c_str(), MOVEFILE_REPLACE_EXISTING) != 0;
+#else
+  return rename(from.c_str(), to.c_str()) == 0;
+#endif
+}
+
+// Gives the driver's compile threads the core between polls
+static void sleepMillisecond() {
+#ifdef _WIN32
+  Sleep(1);
+#else
+  const timespec t = { 0, 1000000 };
+  nanosleep(&t, NULL);
+#endif
+}
+
+static bool hasGlExtension(const char *name) {
+#ifndef __MAC__
+  if (!GLEW_VERSION_3_0)
+    return false;
+#endif
+  GLint n = 0;
+  glGetIntegerv(GL_NUM_EXTENSIONS, &n);
+  for (GLint i = 0; i < n; ++i) {
+    const GLubyte *extension = glGetStringi(GL_EXTENSIONS, i);
+    if (extension && strcmp(reinterpret_cast<const char *>(extension), name) == 0)
+      return true;
+  }
+  return false;
+}
+
+static string glString(GLenum name) {
+  const GLubyte *s = glGetString(name);
+  return s ? reinterpret_cast<const char *>(s) : "";
+}
+
+ProgramCache::ProgramCache(const string& dir)
+  : dir_(dir), binaries_(false), parallel_(false), loaded_(0), compiled_(0) {
+  driver_ = glString(GL_VENDOR) + "\n" + glString(GL_RENDERER) + "\n" + glString(GL_VERSION);
+
+#ifndef __MAC__
+  GLint formats = 0;
+  if (GLEW_VERSION_4_1 || GLEW_ARB_get_program_binary)
+    glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &formats);
+  binaries_ = !dir_.empty() && formats > 0;
+
+  // the extension's default lets the driver use as many threads as it likes
+  parallel_ = hasGlExtension("GL_KHR_parallel_shader_compile") || hasGlExtension("GL_ARB_parallel_shader_compile");
+#endif
+
+  if (binaries_) {
+    // an existing directory is fine, and any other failure shows up when a
+    // binary cannot be written
+#ifdef _WIN32
+    _mkdir(dir_.c_str());
+#else
+    mkdir(dir_.c_str(), 0777);
+#endif
+  }
+}
+
+ProgramCache::~ProgramCache() {
+  // programs left by an exception
+  for (size_t i = 0; i < pending_.size(); ++i) {
+    for (int j = 0; j < 2; ++j) {
+      if (pending_[i].shaders[j])
+        glDeleteShader(pending_[i].shaders[j]);
+    }
+  }
+}
+
+void ProgramCache::addProgram(GLuint programHandle, const char *vertexShaderFileName, const char *fragmentShaderFileName,
+                              int count, const char * const names[], const string& defines) {
+  const GLenum types[2] = { GL_VERTEX_SHADER, GL_FRAGMENT_SHADER };
+  const string sources[2] = {
+    specializeShaderSource(readShaderFile(vertexShaderFileName), defines),
+    specializeShaderSource(readShaderFile(fragmentShaderFileName), defines)
+  };
+
+  Pending p;
+  p.program = programHandle;
+  p.files[0] = vertexShaderFileName;
+  p.files[1] = fragmentShaderFileName;
+  p.defines = defines;
+  start(p, types, sources, count, names);
+}
+
+#ifndef __MAC__
+void ProgramCache::addComputeProgram(GLuint programHandle, const char *computeShaderFileName) {
+  const GLenum types[2] = { GL_COMPUTE_SHADER, 0 };
+  const string sources[2] = { readShaderFile(computeShaderFileName), string() };
+
+  Pending p;
+  p.program = programHandle;
+  p.files[0] = computeShaderFileName;
+  start(p, types, sources, 0, NULL);
+}
+#endif
+
+void ProgramCache::start(Pending& p, const GLenum types[2], const string sources[2], int count, const char * const names[]) {
+  uint64_t h = 14695981039346656037ULL;
+  h = hashString(driver_, h);
+  for (int i = 0; i < 2; ++i) {
+    h = hashBytes(&types[i], sizeof(types[i]), h);
+    h = hashString(sources[i], h);
+  }
+  for (int i = 0; i < count; ++i)
+    h = hashString(names[i], h);
+  if (types[0] == GL_VERTEX_SHADER)
+    h = hashString(g_fragDataName, h);
+  char key[17];
+  sprintf(key, "%08x%08x", (unsigned int)(h >> 32), (unsigned int)h);
+  p.key = key;
+
+  if (binaries_ && loadBinary(p.program, p.key)) {
+    ++loaded_;
+    return;
+  }
+
+  // compile and link with no status queries, which would wait for the driver
+  for (int i = 0; i < 2; ++i) {
+    p.shaders[i] = 0;
+    if (types[i] == 0)
+      continue;
+    p.shaders[i] = glCreateShader(types[i]);
+    if (p.shaders[i] == 0)
+      throw runtime_error("glCreateShader fails");
+    const GLchar *source = sources[i].c_str();
+    const GLint length = (GLint)sources[i].size();
+    glShaderSource(p.shaders[i], 1, &source, &length);
+    glCompileShader(p.shaders[i]);
+    glAttachShader(p.program, p.shaders[i]);
+  }
+  for (int i = 0; i < count; ++i)
+    glBindAttribLocation(p.program, i, names[i]);
+  if (types[0] == GL_VERTEX_SHADER)
+    glBindFragDataLocation(p.program, 0, g_fragDataName);
+#ifndef __MAC__
+  if (binaries_)
+    glProgramParameteri(p.program, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+#endif
+  glLinkProgram(p.program);
+  pending_.push_back(p);
+}
+
+void ProgramCache::finish() {
+  while (!pending_.empty()) {
+    // with parallel compiles, take the programs in the order they are done,
+    // sleeping between polls that find none done
+    const size_t before = pending_.size();
+    for (size_t i = 0; i < pending_.size();) {
+      GLint done = GL_TRUE;
+      if (parallel_)
+        glGetProgramiv(pending_[i].program, GL_COMPLETION_STATUS_KHR, &done);
+      if (!done) {
+        ++i;
+        continue;
+      }
+      complete(pending_[i]);
+      pending_.erase(pending_.begin() + i);
+    }
+    if (pending_.size() == before)
+      sleepMillisecond();
+  }
+  checkGlErrors();
+}
+
+void ProgramCache::complete(Pending& p) {
+  for (int i = 0; i < 2; ++i) {
+    if (!p.shaders[i])
+      continue;
+    GLint compiled = 0;
+    glGetShaderiv(p.shaders[i], GL_COMPILE_STATUS, &compiled);
+    if (!compiled) {
+      GLint logLength = 0;
+      glGetShaderiv(p.shaders[i], GL_INFO_LOG_LENGTH, &logLength);
+      vector<char> log(logLength + 1);
+      glGetShaderInfoLog(p.shaders[i], logLength, NULL, &log[0]);
+      cerr << &log[0] << endl;
+      throw runtime_error("Failed to compile shader " + p.files[i] + (p.defines.empty() ? "" : " for " + p.defines));
+    }
+  }
+
+  GLint linked = 0;
+  glGetProgramiv(p.program, GL_LINK_STATUS, &linked);
+  if (!linked) {
+    GLint logLength = 0;
+    glGetProgramiv(p.program, GL_INFO_LOG_LENGTH, &logLength);
+    vector<char> log(logLength + 1);
+    glGetProgramInfoLog(p.program, logLength, NULL, &log[0]);
+    cerr << &log[0] << endl;
+    throw runtime_error("Failed to link shader " + p.files[0] + (p.shaders[1] ? " with " + p.files[1] : string())
+                        + (p.defines.empty() ? "" : " for " + p.defines));
+  }
+
+  for (int i = 0; i < 2; ++i) {
+    if (p.shaders[i]) {
+      glDetachShader(p.program, p.shaders[i]);
+      glDeleteShader(p.shaders[i]);
+      p.shaders[i] = 0;
+    }
+  }
+  ++compiled_;
+  if (binaries_)
+    storeBinary(p.program, p.key);
+}
+
+bool ProgramCache::loadBinary(GLuint programHandle, const string& key) {
+#ifndef __MAC__
+  const string filename = dir_ + "/" + key + ".bin";
+  GLint linked = 0;
+  try {
+    const MappedFile file(filename.c_str());
+    if (file.size() <= sizeof(g_binaryMagic) + 4 || memcmp(file.data(), g_binaryMagic, sizeof(g_binaryMagic)) != 0)
+      return false;
+    GLenum format;
+    memcpy(&format, file.data() + sizeof(g_binaryMagic), 4);
+    glProgramBinary(programHandle, format, file.data() + sizeof(g_binaryMagic) + 4,
+                    (GLsizei)(file.size() - sizeof(g_binaryMagic) - 4));
+    glGetProgramiv(programHandle, GL_LINK_STATUS, &linked);
+  }
+  catch (const runtime_error&) {
+    return false;  // not cached yet
+  }
+
+  if (!linked) {
+    // from an older driver with the same name: compile, and replace it
+    while (glGetError() != GL_NO_ERROR) {}
+    remove(filename.c_str());
+  }
+  return linked != 0;
+#else
+  return false;
+#endif
+}
+
+void ProgramCache::storeBinary(GLuint programHandle, const string& key) {
+#ifndef __MAC__
+  GLint length = 0;
+  glGetProgramiv(programHandle, GL_PROGRAM_BINARY_LENGTH, &length);
+  if (length <= 0)
+    return;
+  vector<unsigned char> binary(sizeof(g_binaryMagic) + 4 + length);
+  GLenum format = 0;
+  glGetProgramBinary(programHandle, length, NULL, &format, &binary[sizeof(g_binaryMagic) + 4]);
+  memcpy(&binary[0], g_binaryMagic, sizeof(g_binaryMagic));
+  memcpy(&binary[sizeof(g_binaryMagic)], &format, 4);
+
+  // written aside and renamed into place, so that another launch never reads
+  // half a file
+  const string filename = dir_ + "/" + key + ".bin", temp = filename + ".tmp";
+  FILE *f = fopen(temp.c_str(), "wb");
+  bool written = f && fwrite(&binary[0], 1, binary.size(), f) == binary.size();
+  if (f)
+    written = fclose(f) == 0 && written;
+  if (!written || !replaceFile(temp, filename)) {
+    remove(temp.c_str());
+    cerr << "Cannot write shader cache file " << filename << endl;
+  }
+#endif
+}
@@ -0,0 +1,196 @@
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "mappedfile.h"
+#include "qoi.h"
+
+using namespace std;
+
+enum {
+  QOI_OP_INDEX = 0x00,        // 00xxxxxx: color from the table of recent ones
+  QOI_OP_DIFF = 0x40,         // 01rrggbb: each channel off by -2..1
+  QOI_OP_LUMA = 0x80,         // 10gggggg rrrrbbbb: green off by -32..31, red and blue by -8..7 more
+  QOI_OP_RUN = 0xc0,          // 11xxxxxx: the previous pixel 1..62 times
+  QOI_OP_RGB = 0xfe,
+  QOI_OP_RGBA = 0xff,
+  QOI_MASK_2 = 0xc0
+};
+
+static const int QOI_HEADER_SIZE = 14;
+static const unsigned char QOI_PADDING[8] = { 0, 0, 0, 0, 0, 0, 0, 1 };
+
+struct QoiColor {
+  unsigned char r, g, b, a;
+};
+
+static inline int qoiHash(const QoiColor& c) {
+  return (c.r * 3 + c.g * 5 + c.b * 7 + c.a * 11) % 64;
+}
+
+static inline bool operator== (const QoiColor& x, const QoiColor& y) {
+  return x.r == y.r && x.g == y.g && x.b == y.b && x.a == y.a;
+}
+
+static void putU32(unsigned char *p, unsigned int v) {
+  p[0] = v >> 24;
+  p[1] = v >> 16;
+  p[2] = v >> 8;
+  p[3] = v;
+}
+
+static unsigned int getU32(const unsigned char *p) {
+  return (unsigned int)p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+}
+
+void qoiEncode(const unsigned char *pixels, int width, int height, vector<unsigned char>& out) {
+  // the worst case is a tag and three bytes per pixel
+  const size_t start = out.size();
+  out.resize(start + QOI_HEADER_SIZE + (size_t)width * height * 4 + sizeof(QOI_PADDING));
+  unsigned char *const header = &out[start];
+  unsigned char *p = header;
+
+  memcpy(p, "qoif", 4);
+  putU32(p + 4, width);
+  putU32(p + 8, height);
+  p[12] = 3;                  // RGB
+  p[13] = 0;                  // sRGB with linear alpha
+  p += QOI_HEADER_SIZE;
+
+  QoiColor index[64];
+  memset(index, 0, sizeof(index));
+  QoiColor prev = { 0, 0, 0, 255 };
+  int run = 0;
+
+  for (int y = height - 1; y >= 0; --y) {
+    const unsigned char *src = pixels + (size_t)3 * width * y;
+    for (int x = 0; x < width; ++x, src += 3) {
+      const QoiColor px = { src[0], src[1], src[2], 255 };
+
+      if (px == prev) {
+        if (++run == 62) {
+          *p++ = QOI_OP_RUN | (run - 1);
+          run = 0;
+        }
+        continue;
+      }
+      if (run > 0) {
+        *p++ = QOI_OP_RUN | (run - 1);
+        run = 0;
+      }
+
+      const int h = qoiHash(px);
+      if (index[h] == px)
+        *p++ = QOI_OP_INDEX | h;
+      else {
+        index[h] = px;
+
+        const signed char dr = px.r - prev.r, dg = px.g - prev.g, db = px.b - prev.b;
+        const signed char drg = dr - dg, dbg = db - dg;
+        if (dr >= -2 && dr <= 1 && dg >= -2 && dg <= 1 && db >= -2 && db <= 1)
+          *p++ = QOI_OP_DIFF | (dr + 2) << 4 | (dg + 2) << 2 | (db + 2);
+        else if (dg >= -32 && dg <= 31 && drg >= -8 && drg <= 7 && dbg >= -8 && dbg <= 7) {
+          *p++ = QOI_OP_LUMA | (dg + 32);
+          *p++ = (drg + 8) << 4 | (dbg + 8);
+        }
+        else {
+          *p++ = QOI_OP_RGB;
+          *p++ = px.r;
+          *p++ = px.g;
+          *p++ = px.b;
+        }
+      }
+      prev = px;
+    }
+  }
+  if (run > 0)
+    *p++ = QOI_OP_RUN | (run - 1);
+
+  memcpy(p, QOI_PADDING, sizeof(QOI_PADDING));
+  p += sizeof(QOI_PADDING);
+  out.resize(start + (p - header));
+}
+
+void qoiDecode(const unsigned char *data, size_t size, int& width, int& height, vector<PackedPixel>& pixels) {
+  if (size < QOI_HEADER_SIZE + sizeof(QOI_PADDING) || memcmp(data, "qoif", 4))
+    throw runtime_error("qoiRead: bad file format");
+
+  const unsigned int w = getU32(data + 4), h = getU32(data + 8);
+  if (w == 0 || h == 0 || w > 1u << 16 || h > 1u << 16)
+    throw runtime_error("qoiRead: invalid width/height");
+  width = w;
+  height = h;
+
+  const unsigned char *p = data + QOI_HEADER_SIZE;
+  const unsigned char *const end = data + size - sizeof(QOI_PADDING);
+
+  pixels.resize((size_t)w * h);
+  QoiColor index[64];
+  memset(index, 0, sizeof(index));
+  QoiColor px = { 0, 0, 0, 255 };
+  int run = 0;
+
+  for (size_t i = 0; i < pixels.size(); ++i) {
+    if (run > 0)
+      --run;
+    else {
+      if (p >= end)
+        throw runtime_error("qoiRead: file is truncated");
+
+      const int tag = *p++;
+      if (tag == QOI_OP_RGB || tag == QOI_OP_RGBA) {
+        const int n = tag == QOI_OP_RGB ? 3 : 4;
+        if (end - p < n)
+          throw runtime_error("qoiRead: file is truncated");
+        px.r = p[0];
+        px.g = p[1];
+        px.b = p[2];
+        if (n == 4)
+          px.a = p[3];
+        p += n;
+      }
+      else if ((tag & QOI_MASK_2) == QOI_OP_INDEX)
+        px = index[tag];
+      else if ((tag & QOI_MASK_2) == QOI_OP_DIFF) {
+        px.r += ((tag >> 4) & 3) - 2;
+        px.g += ((tag >> 2) & 3) - 2;
+        px.b += (tag & 3) - 2;
+      }
+      else if ((tag & QOI_MASK_2) == QOI_OP_LUMA) {
+        if (p >= end)
+          throw runtime_error("qoiRead: file is truncated");
+        const int dg = (tag & 0x3f) - 32;
+        const int b2 = *p++;
+        px.r += dg - 8 + ((b2 >> 4) & 0x0f);
+        px.g += dg;
+        px.b += dg - 8 + (b2 & 0x0f);
+      }
+      else
+        run = tag & 0x3f;
+      index[qoiHash(px)] = px;
+    }
+
+    pixels[i].r = px.r;
+    pixels[i].g = px.g;
+    pixels[i].b = px.b;
+  }
+}
+
+void writeQoi(const char *filename, int width, int height, const unsigned char *pixels) {
+  vector<unsigned char> encoded;
+  qoiEncode(pixels, width, height, encoded);
+
+  FILE *f = fopen(filename, "wb");
+  if (!f)
+    throw runtime_error(string("writeQoi: Cannot open file ") + filename + " for write");
+  const bool written = fwrite(&encoded[0], 1, encoded.size(), f) == encoded.size();
+  if (fclose(f) != 0 || !written)
+    throw runtime_error(string("writeQoi: Cannot write file ") + filename);
+}
+
+void qoiRead(const char *filename, int& width, int& height, vector<PackedPixel>& pixels) {
+  MappedFile file(filename);
+  qoiDecode(file.data(), file.size(), width, height, pixels);
+}
@@ -0,0 +1,100 @@
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "ppm.h"
+#include "spriteatlas.h"
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#  include <emmintrin.h>
+#  define SPRITEATLAS_USE_SSE2
+#endif
+
+using namespace std;
+
+void downsampleRgbaBox(const unsigned char *src, int width, int height, unsigned char *dst) {
+  const int w = width > 1 ? width / 2 : 1, h = height > 1 ? height / 2 : 1;
+  const size_t pitch = (size_t)4 * width;
+
+  for (int y = 0; y < h; ++y) {
+    const unsigned char *row0 = src + pitch * (2 * y < height ? 2 * y : height - 1);
+    const unsigned char *row1 = src + pitch * (2 * y + 1 < height ? 2 * y + 1 : height - 1);
+    unsigned char *out = dst + (size_t)4 * w * y;
+    int x = 0;
+
+#ifdef SPRITEATLAS_USE_SSE2
+    // four source pixels of both rows to two output pixels at a time, summed
+    // in 16 bit lanes
+    if (width > 1) {
+      const __m128i zero = _mm_setzero_si128();
+      const __m128i two = _mm_set1_epi16(2);
+      for (; x + 2 <= w && 2 * x + 4 <= width; x += 2) {
+        const __m128i a = _mm_loadu_si128((const __m128i *)(row0 + 8 * x));
+        const __m128i b = _mm_loadu_si128((const __m128i *)(row1 + 8 * x));
+        const __m128i lo = _mm_add_epi16(_mm_unpacklo_epi8(a, zero), _mm_unpacklo_epi8(b, zero));  // pixels 0, 1
+        const __m128i hi = _mm_add_epi16(_mm_unpackhi_epi8(a, zero), _mm_unpackhi_epi8(b, zero));  // pixels 2, 3
+        __m128i sum = _mm_add_epi16(_mm_unpacklo_epi64(lo, hi), _mm_unpackhi_epi64(lo, hi));
+        sum = _mm_srli_epi16(_mm_add_epi16(sum, two), 2);
+        _mm_storel_epi64((__m128i *)(out + 4 * x), _mm_packus_epi16(sum, zero));
+      }
+    }
+#endif
+
+    for (; x < w; ++x) {
+      const int x0 = 2 * x < width ? 2 * x : width - 1;
+      const int x1 = 2 * x + 1 < width ? 2 * x + 1 : width - 1;
+      for (int c = 0; c < 4; ++c)
+        out[4 * x + c] = (row0[4 * x0 + c] + row0[4 * x1 + c] + row1[4 * x0 + c] + row1[4 * x1 + c] + 2) >> 2;
+    }
+  }
+}
+
+SpriteAtlas::SpriteAtlas(const vector<string>& files)
+  : frames_((int)files.size()), columns_(0), rows_(0), cellSize_(1) {
+  if (files.empty())
+    throw runtime_error("SpriteAtlas: no frames");
+
+  int frameWidth = 0, frameHeight = 0;
+  for (int i = 0; i < frames_; ++i) {
+    PpmImage frame(files[i].c_str());
+    if (frame.height() % 2 != 0 || (i > 0 && (frame.width() != frameWidth || frame.height() / 2 != frameHeight)))
+      throw runtime_error("Sprite " + files[i] + " must be a color frame above its opacity, the same size as the others");
+
+    if (i == 0) {
+      // square the grid as far as it goes, with power of two cells
+      frameWidth = frame.width();
+      frameHeight = frame.height() / 2;
+      while (cellSize_ < frameWidth || cellSize_ < frameHeight)
+        cellSize_ *= 2;
+      while (columns_ * columns_ < frames_)
+        ++columns_;
+      rows_ = (frames_ + columns_ - 1) / columns_;
+
+      size_t size = 0;
+      for (int level = 0; (cellSize_ >> level) > 0; ++level) {
+        offsets_.push_back(size);
+        size += (size_t)4 * width(level) * height(level);
+      }
+      data_.assign(size, 0);
+    }
+
+    // the cell's top row is the highest of its rows in the texture
+    const int left = (i % columns_) * cellSize_ + (cellSize_ - frameWidth) / 2;
+    const int top = (rows_ - 1 - i / columns_) * cellSize_ + cellSize_ - 1 - (cellSize_ - frameHeight) / 2;
+    for (int y = 0; y < frameHeight; ++y) {
+      const PackedPixel *color = frame.row(y);
+      const PackedPixel *opacity = frame.row(frameHeight + y);
+      unsigned char *out = &data_[(size_t)4 * (width(0) * (top - y) + left)];
+      for (int x = 0; x < frameWidth; ++x, out += 4) {
+        out[0] = color[x].r;
+        out[1] = color[x].g;
+        out[2] = color[x].b;
+        out[3] = opacity[x].r;
+      }
+    }
+  }
+
+  for (int level = 1; level < levels(); ++level)
+    downsampleRgbaBox(&data_[offsets_[level - 1]], width(level - 1), height(level - 1), &data_[offsets_[level]]);
+}
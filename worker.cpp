@@ -0,0 +1,158 @@
+#include <deque>
+#include <exception>
+#include <iostream>
+#include <stdexcept>
+
+#ifdef _WIN32
+# include <windows.h>
+#else
+# include <pthread.h>
+#endif
+
+#include "worker.h"
+
+using namespace std;
+
+// The queue is guarded by one lock, with one condition signalled both when a job
+// arrives and when one leaves
+#ifdef _WIN32
+struct WorkerThread::Impl {
+  HANDLE thread;
+  mutable CRITICAL_SECTION lock;
+  CONDITION_VARIABLE changed;
+
+  void init() {
+    InitializeCriticalSection(&lock);
+    InitializeConditionVariable(&changed);
+  }
+  void destroy() { DeleteCriticalSection(&lock); }
+  void acquire() const { EnterCriticalSection(&lock); }
+  void release() const { LeaveCriticalSection(&lock); }
+  void wait() { SleepConditionVariableCS(&changed, &lock, INFINITE); }
+  void notifyAll() { WakeAllConditionVariable(&changed); }
+
+  static DWORD WINAPI main(LPVOID impl) {
+    static_cast<Impl*>(impl)->loop();
+    return 0;
+  }
+  bool start() {
+    thread = CreateThread(NULL, 0, main, this, 0, NULL);
+    return thread != NULL;
+  }
+  void join() {
+    WaitForSingleObject(thread, INFINITE);
+    CloseHandle(thread);
+  }
+#else
+struct WorkerThread::Impl {
+  pthread_t thread;
+  mutable pthread_mutex_t lock;
+  pthread_cond_t changed;
+
+  void init() {
+    pthread_mutex_init(&lock, NULL);
+    pthread_cond_init(&changed, NULL);
+  }
+  void destroy() {
+    pthread_cond_destroy(&changed);
+    pthread_mutex_destroy(&lock);
+  }
+  void acquire() const { pthread_mutex_lock(&lock); }
+  void release() const { pthread_mutex_unlock(&lock); }
+  void wait() { pthread_cond_wait(&changed, &lock); }
+  void notifyAll() { pthread_cond_broadcast(&changed); }
+
+  static void *main(void *impl) {
+    static_cast<Impl*>(impl)->loop();
+    return NULL;
+  }
+  bool start() {
+    return pthread_create(&thread, NULL, main, this) == 0;
+  }
+  void join() {
+    pthread_join(thread, NULL);
+  }
+#endif
+
+  deque<WorkerJob*> jobs;
+  int maxQueued;
+  bool running;         // a job has been taken off the queue and not finished
+  bool stopping;
+
+  void loop() {
+    acquire();
+    for (;;) {
+      while (jobs.empty() && !stopping)
+        wait();
+      if (jobs.empty())
+        break;
+
+      WorkerJob *job = jobs.front();
+      jobs.pop_front();
+      running = true;
+      notifyAll();
+      release();
+
+      try {
+        job->run();
+      }
+      catch (const exception& e) {
+        cerr << "Background job failed: " << e.what() << endl;
+      }
+      delete job;
+
+      acquire();
+      running = false;
+    }
+    release();
+  }
+};
+
+WorkerThread::WorkerThread(int maxQueued) : impl_(new Impl) {
+  impl_->maxQueued = maxQueued;
+  impl_->running = false;
+  impl_->stopping = false;
+  impl_->init();
+  if (!impl_->start()) {
+    impl_->destroy();
+    delete impl_;
+    throw runtime_error("Cannot start worker thread");
+  }
+}
+
+WorkerThread::~WorkerThread() {
+  impl_->acquire();
+  impl_->stopping = true;
+  impl_->notifyAll();
+  impl_->release();
+  impl_->join();
+  impl_->destroy();
+  delete impl_;
+}
+
+void WorkerThread::post(WorkerJob *job) {
+  impl_->acquire();
+  while ((int)impl_->jobs.size() >= impl_->maxQueued)
+    impl_->wait();
+  impl_->jobs.push_back(job);
+  impl_->notifyAll();
+  impl_->release();
+}
+
+bool WorkerThread::tryPost(WorkerJob *job) {
+  impl_->acquire();
+  const bool room = (int)impl_->jobs.size() < impl_->maxQueued;
+  if (room) {
+    impl_->jobs.push_back(job);
+    impl_->notifyAll();
+  }
+  impl_->release();
+  return room;
+}
+
+int WorkerThread::pending() const {
+  impl_->acquire();
+  const int n = impl_->jobs.size() + (impl_->running ? 1 : 0);
+  impl_->release();
+  return n;
+}